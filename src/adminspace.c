@@ -19,6 +19,7 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/vfs.h>
+#include <linux/vmalloc.h>
 #include "asfs_fs.h"
 #include "bitfuncs.h"
 
@@ -26,13 +27,67 @@
 
 #ifdef CONFIG_ASFS_RW
 
-static int setfreeblocks(struct super_block *sb, u32 freeblocks)
+/* The fsRootInfo counters live in asfs_sb_info and are only written back
+   to the root object container by asfs_writerootinfo(), from write_super()
+   and sync_fs(), instead of on every allocation.
+
+   freeblocks is changed under reserve_lock, together with the check
+   against reservedblocks, so that an allocation can't take blocks which
+   a delayed allocation has just reserved. */
+
+/* Reserved blocks an allocation may not use.  Admin space allocated while
+   asfs_extendfile() allocates delayed blocks may take the metadata which
+   was reserved with them, see asfs_metaestimate().  Called with
+   reserve_lock held. */
+
+static inline u32 reservedfor(struct asfs_sb_info *sbi)
+{
+	return sbi->reservedblocks - (sbi->metaalloc ? sbi->metapool : 0);
+}
+
+static int takefreeblocks(struct super_block *sb, u32 blocks)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+
+	spin_lock(&sbi->reserve_lock);
+	if (sbi->freeblocks < reservedfor(sbi) + blocks) {
+		spin_unlock(&sbi->reserve_lock);
+		return -ENOSPC;
+	}
+	sbi->freeblocks -= blocks;
+	if (sbi->metaalloc) {
+		u32 used = min(sbi->metapool, blocks);
+
+		sbi->metapool -= used;
+		sbi->reservedblocks -= used;
+	}
+	spin_unlock(&sbi->reserve_lock);
+
+	sb->s_dirt = 1;
+	return 0;
+}
+
+static void givefreeblocks(struct super_block *sb, u32 blocks)
 {
+	spin_lock(&ASFS_SB(sb)->reserve_lock);
+	ASFS_SB(sb)->freeblocks += blocks;
+	spin_unlock(&ASFS_SB(sb)->reserve_lock);
+
+	sb->s_dirt = 1;
+}
+
+int asfs_writerootinfo(struct super_block *sb)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
 	struct buffer_head *bh;
-	if ((bh = asfs_breadcheck(sb, ASFS_SB(sb)->rootobjectcontainer, ASFS_OBJECTCONTAINER_ID))) {
+
+	if ((bh = asfs_breadcheck(sb, sbi->rootobjectcontainer, ASFS_OBJECTCONTAINER_ID))) {
 		struct fsRootInfo *ri = (struct fsRootInfo *) ((u8 *) bh->b_data + sb->s_blocksize - sizeof(struct fsRootInfo));
-		ASFS_SB(sb)->freeblocks = freeblocks;
-		ri->freeblocks = cpu_to_be32(freeblocks);
+		ri->freeblocks = cpu_to_be32(sbi->freeblocks);
+		ri->deletedblocks = cpu_to_be32(sbi->deletedblocks);
+		ri->deletedfiles = cpu_to_be32(sbi->deletedfiles);
+		ri->rovingpointer = cpu_to_be32(sbi->block_rovingblockptr);
+		ri->lastallocatedadminspace = cpu_to_be32(sbi->lastallocatedadminspace);
 		asfs_bstore(sb, bh);
 		asfs_brelse(bh);
 		return 0;
@@ -40,24 +95,246 @@ static int setfreeblocks(struct super_block *sb, u32 freeblocks)
 	return -EIO;
 }
 
+/* Called with reserve_lock held. */
+
 static inline int enoughspace(struct super_block *sb, u32 blocks)
 {
-	if (ASFS_SB(sb)->freeblocks - ASFS_ALWAYSFREE < blocks)
+	if (ASFS_SB(sb)->freeblocks < ASFS_ALWAYSFREE + ASFS_SB(sb)->reservedblocks + blocks)
 		return FALSE;
 
 	return TRUE;
 }
 
+static int checkspace(struct super_block *sb, u32 blocks)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	int enough;
+
+	spin_lock(&sbi->reserve_lock);
+	enough = sbi->freeblocks >= ASFS_ALWAYSFREE + reservedfor(sbi) + blocks;
+	spin_unlock(&sbi->reserve_lock);
+
+	return enough;
+}
+
+/* Reserves /blocks/ free blocks for a delayed allocation.  Reserved blocks
+   are not counted as free until they are given back with
+   asfs_unreservespace(), which is done right before they are allocated.
+   Both are called with reserve_lock held instead of lock_super(), so that
+   buffered writes don't wait for allocations in progress. */
+
+int asfs_reservespace(struct super_block *sb, u32 blocks)
+{
+	if (enoughspace(sb, blocks) == FALSE)
+		return -ENOSPC;
+
+	ASFS_SB(sb)->reservedblocks += blocks;
+	return 0;
+}
+
+void asfs_unreservespace(struct super_block *sb, u32 blocks)
+{
+	ASFS_SB(sb)->reservedblocks -= blocks;
+}
+
+/* Worst case number of free blocks the metadata of /blocks/ delayed blocks
+   may take when they are allocated: every block in an extent of its own,
+   extent B-tree containers half full after splits plus as many index
+   containers, all taken from new 32-block admin space areas.  Reserved
+   together with the blocks, so that writeback never runs out of space
+   for data write() has accepted. */
+
+u32 asfs_metaestimate(struct super_block *sb, u32 blocks)
+{
+	u32 nodes = (sb->s_blocksize - sizeof(struct fsBNodeContainer)) / sizeof(struct fsExtentBNode);
+
+	if (blocks == 0)
+		return 0;
+	return 4 * (blocks / nodes + 1) + 32;
+}
+
+/* Recomputes the summary of bitmap block /bitmapblock/ from its contents. */
+
+void asfs_summarizebitmap(struct super_block *sb, u32 bitmapblock, struct fsBitmap *b)
+{
+	struct asfs_bitmapsummary *sum;
+	u32 bits = ASFS_SB(sb)->blocks_inbitmap;
+	int bitstart, bitend = 0;
+
+	if (ASFS_SB(sb)->bitmapsummary == NULL)
+		return;
+
+	sum = &ASFS_SB(sb)->bitmapsummary[bitmapblock - ASFS_SB(sb)->bitmapbase];
+	sum->free = sum->largest = sum->lead = sum->trail = 0;
+	sum->first = bits;
+
+	while (bitend < bits && (bitstart = bmffo(b->bitmap, bits >> 5, bitend)) >= 0) {
+		if ((bitend = bmffz(b->bitmap, bits >> 5, bitstart)) < 0)
+			bitend = bits;
+		if (sum->free == 0)
+			sum->first = bitstart;
+		if (bitstart == 0)
+			sum->lead = bitend;
+		if (bitend == bits)
+			sum->trail = bitend - bitstart;
+		if (bitend - bitstart > sum->largest)
+			sum->largest = bitend - bitstart;
+		sum->free += bitend - bitstart;
+	}
+}
+
+static inline struct asfs_bitmapsummary *getsummary(struct super_block *sb, u32 bitmapblock)
+{
+	struct asfs_bitmapsummary *sum;
+
+	if (ASFS_SB(sb)->bitmapsummary == NULL)
+		return NULL;
+
+	sum = &ASFS_SB(sb)->bitmapsummary[bitmapblock - ASFS_SB(sb)->bitmapbase];
+	return sum->free == ASFS_SUMMARY_UNKNOWN ? NULL : sum;
+}
+
+/* Tells whether the bitmap block describing /block/ may hold a run of
+   /blocks/ free blocks, without reading it. */
+
+int asfs_spacenear(struct super_block *sb, u32 block, u32 blocks)
+{
+	struct asfs_bitmapsummary *sum;
+
+	if (block >= ASFS_SB(sb)->totalblocks)
+		return FALSE;
+	if ((sum = getsummary(sb, ASFS_SB(sb)->bitmapbase + block / ASFS_SB(sb)->blocks_inbitmap)) == NULL)
+		return TRUE;
+	return sum->largest >= blocks;
+}
+
+/* Starts reading up to /count/ bitmap blocks from /bitmapblock/ on, so
+   that a scan finds them in memory instead of waiting for each one in
+   turn.  Blocks known to be full are skipped, scans don't read them, and
+   blocks already in memory (pinned ones too) cost no I/O. */
+
+void asfs_readaheadbitmap(struct super_block *sb, u32 bitmapblock, u32 count)
+{
+	struct asfs_bitmapsummary *sum;
+	u32 last = ASFS_SB(sb)->bitmapbase + ASFS_SB(sb)->blocks_bitmap;
+
+	for (; count > 0 && bitmapblock < last; count--, bitmapblock++)
+		if ((sum = getsummary(sb, bitmapblock)) == NULL || sum->free != 0)
+			sb_breadahead(sb, bitmapblock);
+}
+
+/* With the pinbitmap mount option every fsBitmap block is read and
+   checked once and then kept in memory.  Changes to a block only flag it,
+   its checksum is computed once when it is written back together with
+   the root info.  A block whose buffer is still waiting to be written is
+   stored at once, as without the option. */
+
+int asfs_pinbitmap(struct super_block *sb)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	u32 i;
+
+	if (sbi->bitmap_bh)
+		return 0;
+
+	if (!(sbi->bitmap_bh = vmalloc(sbi->blocks_bitmap * sizeof(struct buffer_head *))))
+		return -ENOMEM;
+	if (!(sbi->bitmap_dirty = vmalloc(sbi->blocks_bitmap))) {
+		vfree(sbi->bitmap_bh);
+		sbi->bitmap_bh = NULL;
+		return -ENOMEM;
+	}
+	memset(sbi->bitmap_dirty, 0, sbi->blocks_bitmap);
+
+	for (i = 0; i < sbi->blocks_bitmap; i++) {
+		if (i % ASFS_BITMAP_READAHEAD == 0)
+			asfs_readaheadbitmap(sb, sbi->bitmapbase + i, ASFS_BITMAP_READAHEAD);
+		if (!(sbi->bitmap_bh[i] = asfs_breadcheck(sb, sbi->bitmapbase + i, ASFS_BITMAP_ID))) {
+			while (i-- > 0)
+				asfs_brelse(sbi->bitmap_bh[i]);
+			vfree(sbi->bitmap_dirty);
+			vfree(sbi->bitmap_bh);
+			sbi->bitmap_bh = NULL;
+			return -EIO;
+		}
+		asfs_summarizebitmap(sb, sbi->bitmapbase + i, (void *) sbi->bitmap_bh[i]->b_data);
+	}
+
+	asfs_debug("pinbitmap: %u bitmap blocks pinned\n", sbi->blocks_bitmap);
+	return 0;
+}
+
+void asfs_writebitmap(struct super_block *sb)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	u32 i;
+
+	if (sbi->bitmap_bh == NULL)
+		return;
+
+	for (i = 0; i < sbi->blocks_bitmap; i++)
+		if (sbi->bitmap_dirty[i]) {
+			sbi->bitmap_dirty[i] = 0;
+			asfs_bstore(sb, sbi->bitmap_bh[i]);
+		}
+}
+
+void asfs_unpinbitmap(struct super_block *sb)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	u32 i;
+
+	if (sbi->bitmap_bh == NULL)
+		return;
+
+	asfs_writebitmap(sb);
+	for (i = 0; i < sbi->blocks_bitmap; i++)
+		asfs_brelse(sbi->bitmap_bh[i]);
+	vfree(sbi->bitmap_dirty);
+	vfree(sbi->bitmap_bh);
+	sbi->bitmap_bh = NULL;
+	sbi->bitmap_dirty = NULL;
+}
+
+/* Every bitmap block is read with asfs_getbitmap(), released with
+   asfs_brelse() and, if changed, stored with asfs_storebitmap(). */
+
+struct buffer_head *asfs_getbitmap(struct super_block *sb, u32 bitmapblock)
+{
+	struct buffer_head *bh;
+
+	if (ASFS_SB(sb)->bitmap_bh == NULL)
+		return asfs_breadcheck(sb, bitmapblock, ASFS_BITMAP_ID);
+
+	bh = ASFS_SB(sb)->bitmap_bh[bitmapblock - ASFS_SB(sb)->bitmapbase];
+	get_bh(bh);
+	return bh;
+}
+
+static void asfs_storebitmap(struct super_block *sb, struct buffer_head *bh)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+
+	if (sbi->bitmap_bh != NULL && !buffer_dirty(bh)) {
+		sbi->bitmap_dirty[bh->b_blocknr - sbi->bitmapbase] = 1;
+		sb->s_dirt = 1;
+	} else
+		asfs_bstore(sb, bh);
+}
+
+#ifdef ASFS_CHECK_MARKSPACE
+
 	/* Determines the amount of free blocks starting from block /block/.
 	   If there are no blocks found or if there was an error -1 is returned,
 	   otherwise this function will count the number of free blocks until
 	   an allocated block is encountered or until maxneeded has been
-	   exceeded. */
+	   exceeded.  Bitmap blocks known to be full or empty are not read. */
 
 static int availablespace(struct super_block *sb, u32 block, u32 maxneeded)
 {
-	struct buffer_head *bh = NULL;
+	struct buffer_head *bh;
 	struct fsBitmap *b;
+	struct asfs_bitmapsummary *sum;
 	u32 longs = ASFS_SB(sb)->blocks_inbitmap >> 5;
 	u32 maxbitmapblock = ASFS_SB(sb)->bitmapbase + ASFS_SB(sb)->blocks_bitmap;
 	int blocksfound = 0;
@@ -67,41 +344,59 @@ static int availablespace(struct super_block *sb, u32 block, u32 maxneeded)
 
 	bitstart = block % ASFS_SB(sb)->blocks_inbitmap;
 
-	while (nextblock < maxbitmapblock && (bh = asfs_breadcheck(sb, nextblock++, ASFS_BITMAP_ID))) {
-		b = (void *) bh->b_data;
+	if (nextblock >= maxbitmapblock)
+		return (-1);
 
-		if ((bitend = bmffz(b->bitmap, longs, bitstart)) >= 0) {
-			blocksfound += bitend - bitstart;
-			asfs_brelse(bh);
+	asfs_readaheadbitmap(sb, nextblock, min(maxneeded / ASFS_SB(sb)->blocks_inbitmap + 2, (u32) ASFS_BITMAP_READAHEAD));
+
+	while (nextblock < maxbitmapblock) {
+		if ((sum = getsummary(sb, nextblock)) != NULL && sum->free == 0)
 			return blocksfound;
+
+		if (sum != NULL && sum->free == ASFS_SB(sb)->blocks_inbitmap)
+			nextblock++;
+		else {
+			if (!(bh = asfs_getbitmap(sb, nextblock)))
+				return (-1);
+			b = (void *) bh->b_data;
+
+			if (sum == NULL)
+				asfs_summarizebitmap(sb, nextblock, b);
+			nextblock++;
+
+			if ((bitend = bmffz(b->bitmap, longs, bitstart)) >= 0) {
+				blocksfound += bitend - bitstart;
+				asfs_brelse(bh);
+				return blocksfound;
+			}
+			asfs_brelse(bh);
 		}
+
 		blocksfound += ASFS_SB(sb)->blocks_inbitmap - bitstart;
-		if (blocksfound >= maxneeded) {
-			asfs_brelse(bh);
+		if (blocksfound >= maxneeded)
 			return blocksfound;
-		}
 		bitstart = 0;
-		asfs_brelse(bh);
 	}
 
-	if (bh == NULL)
-		return (-1);
-
 	return (blocksfound);
 }
 
+#endif
+
 int asfs_findspace(struct super_block *sb, u32 maxneeded, u32 start, u32 end, u32 * returned_block, u32 * returned_blocks)
 {
 	struct buffer_head *bh;
+	struct asfs_bitmapsummary *sum;
 	u32 longs = ASFS_SB(sb)->blocks_inbitmap >> 5;
 	u32 space = 0;
 	u32 block;
-	u32 bitmapblock = ASFS_SB(sb)->bitmapbase + start / ASFS_SB(sb)->blocks_inbitmap;
+	u32 bitmapblock;
 	u32 breakpoint;
+	u32 ranext = 0;
 	int bitstart, bitend;
 	int reads;
 
-	if (enoughspace(sb, maxneeded) == FALSE) {
+	if (checkspace(sb, maxneeded) == FALSE) {
 		*returned_block = 0;
 		*returned_blocks = 0;
 		return -ENOSPC;
@@ -109,10 +404,18 @@ int asfs_findspace(struct super_block *sb, u32 maxneeded, u32 start, u32 end, u3
 
 	if (start >= ASFS_SB(sb)->totalblocks)
 		start -= ASFS_SB(sb)->totalblocks;
+	bitmapblock = ASFS_SB(sb)->bitmapbase + start / ASFS_SB(sb)->blocks_inbitmap;
 
 	if (end == 0)
 		end = ASFS_SB(sb)->totalblocks;
 
+	/* Searches of the whole disk are answered by the free space index,
+	   the bitmap is only read to build it. */
+	if (start == end || (start == 0 && end == ASFS_SB(sb)->totalblocks)) {
+		if (ASFS_SB(sb)->space_indexed || (!ASFS_SB(sb)->space_noindex && asfs_buildspaceindex(sb) == 0))
+			return asfs_searchspaceindex(sb, maxneeded, start, returned_block, returned_blocks);
+	}
+
 	reads = ((end - 1) / ASFS_SB(sb)->blocks_inbitmap) + 1 - start / ASFS_SB(sb)->blocks_inbitmap;
 
 	if (start >= end)
@@ -126,56 +429,87 @@ int asfs_findspace(struct super_block *sb, u32 maxneeded, u32 start, u32 end, u3
 	bitend = start % ASFS_SB(sb)->blocks_inbitmap;
 	block = start - bitend;
 
-	while ((bh = asfs_breadcheck(sb, bitmapblock++, ASFS_BITMAP_ID))) {
-		struct fsBitmap *b = (void *) bh->b_data;
-		u32 localbreakpoint = breakpoint - block;
+	for (;;) {
+		sum = getsummary(sb, bitmapblock);
+
+		/* A whole bitmap block which can't give a longer run than the
+		   one already found is skipped, only the free blocks at its
+		   end are carried over to the next one. */
+
+		if (sum != NULL && bitend == 0 && breakpoint - block >= ASFS_SB(sb)->blocks_inbitmap &&
+		    space + sum->lead <= *returned_blocks && sum->largest <= *returned_blocks) {
+			if (sum->free == ASFS_SB(sb)->blocks_inbitmap)
+				space += sum->free;
+			else
+				space = sum->trail;
+			bitmapblock++;
+		} else {
+			struct fsBitmap *b;
+			u32 localbreakpoint = breakpoint - block;
+
+			if (bitmapblock >= ranext) {
+				asfs_readaheadbitmap(sb, bitmapblock, min(reads, ASFS_BITMAP_READAHEAD));
+				ranext = bitmapblock + ASFS_BITMAP_READAHEAD;
+			}
+			if (!(bh = asfs_getbitmap(sb, bitmapblock)))
+				return -EIO;
+			b = (void *) bh->b_data;
+
+			if (sum == NULL)
+				asfs_summarizebitmap(sb, bitmapblock, b);
+			else if (bitend < sum->first && sum->first < ASFS_SB(sb)->blocks_inbitmap)
+				bitend = sum->first;
+			bitmapblock++;
 
-		if (localbreakpoint > ASFS_SB(sb)->blocks_inbitmap)
-			localbreakpoint = ASFS_SB(sb)->blocks_inbitmap;
+			if (localbreakpoint > ASFS_SB(sb)->blocks_inbitmap)
+				localbreakpoint = ASFS_SB(sb)->blocks_inbitmap;
 
-		/* At this point space contains the amount of free blocks at
-		   the end of the previous bitmap block.  If there are no
-		   free blocks at the start of this bitmap block, space will
-		   be set to zero, since in that case the space isn't adjacent. */
+			/* At this point space contains the amount of free blocks at
+			   the end of the previous bitmap block.  If there are no
+			   free blocks at the start of this bitmap block, space will
+			   be set to zero, since in that case the space isn't adjacent. */
 
-		while ((bitstart = bmffo(b->bitmap, longs, bitend)) < ASFS_SB(sb)->blocks_inbitmap) {
-			/* found the start of an empty space, now find out how large it is */
+			while ((bitstart = bmffo(b->bitmap, longs, bitend)) < ASFS_SB(sb)->blocks_inbitmap) {
+				/* found the start of an empty space, now find out how large it is */
 
-			if (bitstart >= localbreakpoint)
-				break;
+				if (bitstart >= localbreakpoint)
+					break;
 
-			if (bitstart != 0)
-				space = 0;
+				if (bitstart != 0)
+					space = 0;
 
-			bitend = bmffz(b->bitmap, longs, bitstart);
+				bitend = bmffz(b->bitmap, longs, bitstart);
 
-			if (bitend > localbreakpoint)
-				bitend = localbreakpoint;
+				if (bitend > localbreakpoint)
+					bitend = localbreakpoint;
 
-			space += bitend - bitstart;
+				space += bitend - bitstart;
 
-			if (*returned_blocks < space) {
-				*returned_block = block + bitend - space;
-				if (space >= maxneeded) {
-					*returned_blocks = maxneeded;
-					asfs_brelse(bh);
-					return 0;
+				if (*returned_blocks < space) {
+					*returned_block = block + bitend - space;
+					if (space >= maxneeded) {
+						*returned_blocks = maxneeded;
+						asfs_brelse(bh);
+						return 0;
+					}
+					*returned_blocks = space;
 				}
-				*returned_blocks = space;
+
+				if (bitend >= localbreakpoint)
+					break;
 			}
 
-			if (bitend >= localbreakpoint)
-				break;
+			/* no (more) empty spaces found in this block */
+
+			if (bitend != ASFS_SB(sb)->blocks_inbitmap)
+				space = 0;
+
+			asfs_brelse(bh);
 		}
 
 		if (--reads == 0)
 			break;
 
-		/* no (more) empty spaces found in this block */
-
-		if (bitend != ASFS_SB(sb)->blocks_inbitmap)
-			space = 0;
-
 		bitend = 0;
 		block += ASFS_SB(sb)->blocks_inbitmap;
 
@@ -184,54 +518,87 @@ int asfs_findspace(struct super_block *sb, u32 maxneeded, u32 start, u32 end, u3
 			space = 0;
 			breakpoint = end;
 			bitmapblock = ASFS_SB(sb)->bitmapbase;
+			ranext = 0;
 		}
-		asfs_brelse(bh);
 	}
 
-	if (bh == NULL)
-		return -EIO;
-
-	asfs_brelse(bh);
-
 	if (*returned_blocks == 0)
 		return -ENOSPC;
 	else
 		return 0;
 }
 
+/* Sets (frees) or clears (marks used) /blocks/ bits of the bitmap from
+   block /block/ on, one pass over each bitmap block.  When marking, every
+   bitmap block is checked to have the run free before it is changed, and
+   the blocks changed so far are given back if it hasn't. */
+
+static int changebitmap(struct super_block *sb, u32 block, u32 blocks, int free)
+{
+	struct buffer_head *bh;
+	u32 skipblocks = block / ASFS_SB(sb)->blocks_inbitmap;
+	u32 longs = (sb->s_blocksize - sizeof(struct fsBitmap)) >> 2;
+	u32 bitmapblock = ASFS_SB(sb)->bitmapbase + skipblocks;
+	u32 orgblock = block, done = 0;
+	u32 bit = block - skipblocks * ASFS_SB(sb)->blocks_inbitmap;
+
+	while (done < blocks) {
+		struct fsBitmap *b;
+		int used;
+
+		if (!(bh = asfs_getbitmap(sb, bitmapblock))) {
+			asfs_dropspaceindex(sb);
+			return -EIO;
+		}
+		b = (void *) bh->b_data;
+
+		if (!free && (used = bmffz(b->bitmap, longs, bit)) >= 0 && used < bit + blocks - done) {
+			printk("ASFS: Attempted to mark %d blocks from block %d, but some of them were already full!\n", blocks, orgblock);
+			asfs_brelse(bh);
+			if (done > 0)
+				changebitmap(sb, orgblock, done, TRUE);
+			return -EIO;
+		}
+
+		if (free)
+			done += bmset(b->bitmap, longs, bit, blocks - done);
+		else
+			done += bmclr(b->bitmap, longs, bit, blocks - done);
+		bit = 0;
+		asfs_summarizebitmap(sb, bitmapblock++, b);
+
+		asfs_storebitmap(sb, bh);
+		asfs_brelse(bh);
+	}
+
+	return 0;
+}
+
+	/* Marks a run found by asfs_findspace() as used.  The run is verified
+	   to be free while it is marked, define ASFS_CHECK_MARKSPACE to have
+	   it checked with availablespace() up front as well. */
+
 int asfs_markspace(struct super_block *sb, u32 block, u32 blocks)
 {
 	int errorcode;
 
 	asfs_debug("markspace: Marking %d blocks from block %d\n", blocks, block);
 
+#ifdef ASFS_CHECK_MARKSPACE
 	if ((availablespace(sb, block, blocks)) < blocks) {
 		printk("ASFS: Attempted to mark %d blocks from block %d, but some of them were already full!\n", blocks, block);
 		return -EIO;
 	}
+#endif
 
-	if ((errorcode = setfreeblocks(sb, ASFS_SB(sb)->freeblocks - blocks)) == 0) {
-		struct buffer_head *bh;
-		u32 skipblocks = block / ASFS_SB(sb)->blocks_inbitmap;
-		u32 longs = (sb->s_blocksize - sizeof(struct fsBitmap)) >> 2;
-		u32 bitmapblock;
-
-		block -= skipblocks * ASFS_SB(sb)->blocks_inbitmap;
-		bitmapblock = ASFS_SB(sb)->bitmapbase + skipblocks;
-
-		while (blocks > 0) {
-			if ((bh = asfs_breadcheck(sb, bitmapblock++, ASFS_BITMAP_ID))) {
-				struct fsBitmap *b = (void *) bh->b_data;
-
-				blocks -= bmclr(b->bitmap, longs, block, blocks);
-				block = 0;
+	if ((errorcode = takefreeblocks(sb, blocks)) != 0)
+		return errorcode;
 
-				asfs_bstore(sb, bh);
-				asfs_brelse(bh);
-			} else
-				return -EIO;
-		}
-	}
+	if ((errorcode = changebitmap(sb, block, blocks, FALSE)) == 0) {
+		asfs_markspaceindex(sb, block, blocks);
+		asfs_canceldiscard(sb, block, blocks);
+	} else
+		givefreeblocks(sb, blocks);
 
 	return (errorcode);
 }
@@ -253,15 +620,21 @@ static inline int internalfindspace(struct super_block *sb, u32 blocksneeded, u3
 	return errorcode;
 }
 
-static int findandmarkspace(struct super_block *sb, u32 blocksneeded, u32 * returned_block)
+	/* Same as internalfindspace() over the whole disk, starting at /goal/,
+	   and marks the found blocks as used.  Only used for admin space
+	   areas, which may take the metadata reserved by delayed blocks. */
+
+static int findandmarkspace(struct super_block *sb, u32 blocksneeded, u32 goal, u32 * returned_block)
 {
 	int errorcode;
 
-	if (enoughspace(sb, blocksneeded) != FALSE) {
-		if ((errorcode = internalfindspace(sb, blocksneeded, 0, ASFS_SB(sb)->totalblocks, returned_block)) == 0)
+	ASFS_SB(sb)->metaalloc = TRUE;
+	if (checkspace(sb, blocksneeded) != FALSE) {
+		if ((errorcode = internalfindspace(sb, blocksneeded, goal, goal, returned_block)) == 0)
 			errorcode = asfs_markspace(sb, *returned_block, blocksneeded);
 	} else
 		errorcode = -ENOSPC;
+	ASFS_SB(sb)->metaalloc = FALSE;
 
 	return (errorcode);
 }
@@ -274,173 +647,379 @@ int asfs_freespace(struct super_block *sb, u32 block, u32 blocks)
 
 	asfs_debug("freespace: Freeing %d blocks from block %d\n", blocks, block);
 
-	if ((errorcode = setfreeblocks(sb, ASFS_SB(sb)->freeblocks + blocks)) == 0) {
-		struct buffer_head *bh;
-		u32 skipblocks = block / ASFS_SB(sb)->blocks_inbitmap;
-		u32 longs = (sb->s_blocksize - sizeof(struct fsBitmap)) >> 2;
-		u32 bitmapblock;
+	givefreeblocks(sb, blocks);
+	asfs_freespaceindex(sb, block, blocks);
+	if ((errorcode = changebitmap(sb, block, blocks, TRUE)) == 0 && (ASFS_SB(sb)->flags & ASFS_DISCARD))
+		asfs_queuediscard(sb, block, blocks);
 
-		block -= skipblocks * ASFS_SB(sb)->blocks_inbitmap;
-		bitmapblock = ASFS_SB(sb)->bitmapbase + skipblocks;
+	return (errorcode);
+}
 
-		while (blocks > 0) {
-			if ((bh = asfs_breadcheck(sb, bitmapblock++, ASFS_BITMAP_ID))) {
-				struct fsBitmap *b = (void *) bh->b_data;
+/*************** admin space containers ****************/
 
-				blocks -= bmset(b->bitmap, longs, block, blocks);
-				block = 0;
+/* All fsAdminSpace areas are kept in memory, in an array sorted by start
+   block, together with the fsAdminSpaceContainer block and slot holding
+   them on disk.  Freeing an admin block is a binary search and allocating
+   one reads only the container of the chosen area, the chain is walked
+   once when the array is built.  New areas are only ever added to the last
+   container of the chain.
 
-				asfs_bstore(sb, bh);
-				asfs_brelse(bh);
-			} else
-				return -EIO;
-		}
+   A binary tree of counts over the array, kept in sync by setadminbits(),
+   tells which areas still have free blocks, so finding one doesn't look
+   at full areas.  Leaf adminnonfull_leaves + i is 1 if area i isn't full,
+   every other node holds the sum of its two children. */
+
+/* Returns the index of the first area starting after /block/, so the
+   area holding or preceding /block/ is the one before it. */
+
+static u32 adminareaindex(struct asfs_sb_info *sbi, u32 block)
+{
+	u32 lo = 0, hi = sbi->adminarea_count;
+
+	while (lo < hi) {
+		u32 mid = (lo + hi) / 2;
+
+		if (sbi->adminareas[mid].space <= block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int addadminarea(struct asfs_sb_info *sbi, u32 space, u32 bits, u32 container, u32 slot)
+{
+	struct asfs_adminarea *area;
+	u32 i;
+
+	if (sbi->adminarea_count == sbi->adminarea_size) {
+		u32 size = sbi->adminarea_size ? sbi->adminarea_size * 2 : 32;
+
+		if (!(area = krealloc(sbi->adminareas, size * sizeof(struct asfs_adminarea), GFP_NOFS)))
+			return -ENOMEM;
+		sbi->adminareas = area;
+		sbi->adminarea_size = size;
 	}
 
-	return (errorcode);
+	i = adminareaindex(sbi, space);
+	if (i <= sbi->adminarea_hint && sbi->adminarea_count > 0)
+		sbi->adminarea_hint++;
+	area = &sbi->adminareas[i];
+	memmove(area + 1, area, (sbi->adminarea_count - i) * sizeof(struct asfs_adminarea));
+	area->space = space;
+	area->bits = bits;
+	area->container = container;
+	area->slot = slot;
+	sbi->adminarea_count++;
+
+	return 0;
 }
 
-/*************** admin space containers ****************/
+/* Builds the tree of non-full areas from scratch, needed whenever areas
+   are added as that moves them in the array. */
+
+static int buildnonfull(struct asfs_sb_info *sbi)
+{
+	u32 leaves = 1;
+	u32 i;
+
+	while (leaves < sbi->adminarea_count)
+		leaves *= 2;
+
+	if (leaves != sbi->adminnonfull_leaves) {
+		kfree(sbi->adminnonfull);
+		sbi->adminnonfull_leaves = 0;
+		if (!(sbi->adminnonfull = kmalloc(2 * leaves * sizeof(u32), GFP_NOFS)))
+			return -ENOMEM;
+		sbi->adminnonfull_leaves = leaves;
+	}
+
+	for (i = 0; i < leaves; i++)
+		sbi->adminnonfull[leaves + i] = i < sbi->adminarea_count && sbi->adminareas[i].bits != 0xFFFFFFFF;
+	for (i = leaves - 1; i > 0; i--)
+		sbi->adminnonfull[i] = sbi->adminnonfull[2 * i] + sbi->adminnonfull[2 * i + 1];
+
+	return 0;
+}
+
+static void updatenonfull(struct asfs_sb_info *sbi, struct asfs_adminarea *area)
+{
+	u32 n = sbi->adminnonfull_leaves + (area - sbi->adminareas);
+
+	sbi->adminnonfull[n] = area->bits != 0xFFFFFFFF;
+	for (n /= 2; n > 0; n /= 2)
+		sbi->adminnonfull[n] = sbi->adminnonfull[2 * n] + sbi->adminnonfull[2 * n + 1];
+}
+
+/* Returns the first area from index /from/ on which isn't full, wrapping
+   around to the start of the array, or NULL if all are full. */
 
-int asfs_allocadminspace(struct super_block *sb, u32 *returned_block)
+static struct asfs_adminarea *findnonfull(struct asfs_sb_info *sbi, u32 from)
 {
+	u32 *tree = sbi->adminnonfull;
+	u32 n = sbi->adminnonfull_leaves + from;
+
+	if (tree[1] == 0)
+		return NULL;
+
+	/* climb until a right sibling has non-full areas, else start at the root */
+	if (tree[n] == 0) {
+		while (n > 1 && ((n & 1) || tree[n + 1] == 0))
+			n /= 2;
+		n = n > 1 ? n + 1 : 1;
+	}
+	while (n < sbi->adminnonfull_leaves)
+		n = tree[2 * n] ? 2 * n : 2 * n + 1;
+
+	return &sbi->adminareas[n - sbi->adminnonfull_leaves];
+}
+
+/* Returns the area holding admin block /block/, or NULL. */
+
+static struct asfs_adminarea *findadminarea(struct asfs_sb_info *sbi, u32 block)
+{
+	u32 lo = adminareaindex(sbi, block);
+
+	if (lo == 0 || block >= sbi->adminareas[lo - 1].space + 32)
+		return NULL;
+	return &sbi->adminareas[lo - 1];
+}
+
+void asfs_dropadminareas(struct super_block *sb)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+
+	kfree(sbi->adminareas);
+	sbi->adminareas = NULL;
+	kfree(sbi->adminnonfull);
+	sbi->adminnonfull = NULL;
+	sbi->adminnonfull_leaves = 0;
+	sbi->adminarea_count = 0;
+	sbi->adminarea_size = 0;
+	sbi->adminarea_hint = 0;
+}
+
+static int buildadminareas(struct super_block *sb)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
 	struct buffer_head *bh;
-	u32 adminspaceblock = ASFS_SB(sb)->adminspacecontainer;
-	int errorcode = -EIO;
+	u32 adminspaceblock = sbi->adminspacecontainer;
+	int adminspaces = (sb->s_blocksize - sizeof(struct fsAdminSpaceContainer)) / sizeof(struct fsAdminSpace);
+	int slot, error = 0;
+	u32 i;
 
-	asfs_debug("allocadminspace: allocating new block\n");
+	while (adminspaceblock != 0 && error == 0) {
+		struct fsAdminSpaceContainer *asc;
 
-	while ((bh = asfs_breadcheck(sb, adminspaceblock, ASFS_ADMINSPACECONTAINER_ID))) {
-		struct fsAdminSpaceContainer *asc1 = (void *) bh->b_data;
-		struct fsAdminSpace *as1 = asc1->adminspace;
-		int adminspaces1 = (sb->s_blocksize - sizeof(struct fsAdminSpaceContainer)) / sizeof(struct fsAdminSpace);
+		if (!(bh = asfs_breadcheck(sb, adminspaceblock, ASFS_ADMINSPACECONTAINER_ID))) {
+			error = -EIO;
+			break;
+		}
+		asc = (void *) bh->b_data;
 
-		while (adminspaces1-- > 0) {
-			s16 bitoffset;
+		for (slot = 0; slot < adminspaces && error == 0; slot++)
+			if (asc->adminspace[slot].space != 0)
+				error = addadminarea(sbi, be32_to_cpu(asc->adminspace[slot].space), be32_to_cpu(asc->adminspace[slot].bits), adminspaceblock, slot);
 
-			if (as1->space != 0 && (bitoffset = bfffz(be32_to_cpu(as1->bits), 0)) >= 0) {
-				u32 emptyadminblock = be32_to_cpu(as1->space) + bitoffset;
-				as1->bits |= cpu_to_be32(1 << (31 - bitoffset));
-				asfs_bstore(sb, bh);
-				*returned_block = emptyadminblock;
-				asfs_brelse(bh);
-				asfs_debug("allocadminspace: found block %d\n", *returned_block);
-				return 0;
-			}
-			as1++;
+		sbi->adminlastcontainer = adminspaceblock;
+		adminspaceblock = be32_to_cpu(asc->next);
+		asfs_brelse(bh);
+	}
+
+	if (error == 0 && sbi->adminarea_count == 0)
+		error = -EIO;
+	if (error == 0)
+		error = buildnonfull(sbi);
+	if (error) {
+		asfs_dropadminareas(sb);
+		return error;
+	}
+
+	/* start where the last session allocated from */
+	for (i = 0; i < sbi->adminarea_count; i++)
+		if (sbi->adminareas[i].container == sbi->lastallocatedadminspace) {
+			sbi->adminarea_hint = i;
+			break;
 		}
 
-		adminspaceblock = be32_to_cpu(asc1->next);
+	return 0;
+}
+
+static int setadminbits(struct super_block *sb, struct asfs_adminarea *area, u32 bits)
+{
+	struct buffer_head *bh;
+	struct fsAdminSpace *as;
+
+	if (!(bh = asfs_breadcheck(sb, area->container, ASFS_ADMINSPACECONTAINER_ID)))
+		return -EIO;
+
+	as = &((struct fsAdminSpaceContainer *) bh->b_data)->adminspace[area->slot];
+	if (be32_to_cpu(as->space) != area->space) {
+		printk(KERN_ERR "ASFS: Admin space area %u not found in container %u\n", area->space, area->container);
 		asfs_brelse(bh);
+		return -EIO;
+	}
 
-		if (adminspaceblock == 0) {
-			u32 startblock;
+	as->bits = cpu_to_be32(bits);
+	asfs_bstore(sb, bh);
+	asfs_brelse(bh);
+	area->bits = bits;
+	updatenonfull(ASFS_SB(sb), area);
 
-			asfs_debug("allocadminspace: allocating new adminspace area\n");
+	return 0;
+}
 
-			/* If we get here it means current adminspace areas are all filled.
-			   We would now need to find a new area and create a fsAdminSpace
-			   structure in one of the AdminSpaceContainer blocks.  If these
-			   don't have any room left for new adminspace areas a new
-			   AdminSpaceContainer would have to be created first which is
-			   placed as the first block in the newly found admin area. */
+/* Adds an area created after the array was built.  If memory runs out,
+   everything is dropped and read again from disk on the next call. */
 
-			adminspaceblock = ASFS_SB(sb)->adminspacecontainer;
+static int insertadminarea(struct super_block *sb, u32 space, u32 bits, u32 container, u32 slot)
+{
+	int error;
 
-			if ((errorcode = findandmarkspace(sb, 32, &startblock)))
-				return errorcode;
+	if ((error = addadminarea(ASFS_SB(sb), space, bits, container, slot)) == 0)
+		error = buildnonfull(ASFS_SB(sb));
+	if (error)
+		asfs_dropadminareas(sb);
+	return error;
+}
 
-			while ((bh = asfs_breadcheck(sb, adminspaceblock, ASFS_ADMINSPACECONTAINER_ID))) {
-				struct fsAdminSpaceContainer *asc2 = (void *) bh->b_data;
-				struct fsAdminSpace *as2 = asc2->adminspace;
-				int adminspaces2 = (sb->s_blocksize - sizeof(struct fsAdminSpaceContainer)) / sizeof(struct fsAdminSpace);
+	/* Marks 32 new blocks near /goal/ as admin space and records them in a free
+	   fsAdminSpace of the last AdminSpaceContainer.  If it is full, the
+	   first block of the new area becomes a new AdminSpaceContainer which
+	   is linked to the end of the chain. */
 
-				while (adminspaces2-- > 0 && as2->space != 0)
-					as2++;
+static int newadminarea(struct super_block *sb, u32 goal)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct buffer_head *bh;
+	struct fsAdminSpaceContainer *asc;
+	int adminspaces = (sb->s_blocksize - sizeof(struct fsAdminSpaceContainer)) / sizeof(struct fsAdminSpace);
+	u32 startblock;
+	int slot, errorcode;
 
-				if (adminspaces2 >= 0) {	/* Found a unused AdminSpace in this AdminSpaceContainer! */
-					as2->space = cpu_to_be32(startblock);
-					as2->bits = 0;
-					asfs_bstore(sb, bh);
-					asfs_brelse(bh);
-					break;
-				}
+	asfs_debug("allocadminspace: allocating new adminspace area\n");
 
-				if (asc2->next == 0) {
-					/* Oh-oh... we marked our new adminspace area in use, but we couldn't
-					   find space to store a fsAdminSpace structure in the existing
-					   fsAdminSpaceContainer blocks.  This means we need to create and
-					   link a new fsAdminSpaceContainer as the first block in our newly
-					   marked adminspace. */
+	if ((errorcode = findandmarkspace(sb, 32, goal, &startblock)))
+		return errorcode;
 
-					asc2->next = cpu_to_be32(startblock);
-					asfs_bstore(sb, bh);
-					asfs_brelse(bh);
+	if (!(bh = asfs_breadcheck(sb, sbi->adminlastcontainer, ASFS_ADMINSPACECONTAINER_ID)))
+		return -EIO;
+	asc = (void *) bh->b_data;
 
-					/* Now preparing new AdminSpaceContainer */
+	for (slot = 0; slot < adminspaces && asc->adminspace[slot].space != 0; slot++);
 
-					if ((bh = asfs_getzeroblk(sb, startblock)) == NULL)
-						return -EIO;
+	if (slot < adminspaces) {
+		asc->adminspace[slot].space = cpu_to_be32(startblock);
+		asc->adminspace[slot].bits = 0;
+		asfs_bstore(sb, bh);
+		asfs_brelse(bh);
+		return insertadminarea(sb, startblock, 0, sbi->adminlastcontainer, slot);
+	}
 
-					asc2 = (void *) bh->b_data;
-					asc2->bheader.id = cpu_to_be32(ASFS_ADMINSPACECONTAINER_ID);
-					asc2->bheader.ownblock = cpu_to_be32(startblock);
-					asc2->previous = cpu_to_be32(adminspaceblock);
-					asc2->adminspace[0].space = cpu_to_be32(startblock);
-					asc2->adminspace[0].bits = cpu_to_be32(0x80000000);
-					asc2->bits = 32;
+	asc->next = cpu_to_be32(startblock);
+	asfs_bstore(sb, bh);
+	asfs_brelse(bh);
 
-					asfs_bstore(sb, bh);
-					asfs_brelse(bh);
+	if ((bh = asfs_getzeroblk(sb, startblock)) == NULL)
+		return -EIO;
 
-					adminspaceblock = startblock;
-					break;	/* Breaks through to outer loop! */
-				}
-				adminspaceblock = be32_to_cpu(asc2->next);
-				asfs_brelse(bh);
-			}
-		}
+	asc = (void *) bh->b_data;
+	asc->bheader.id = cpu_to_be32(ASFS_ADMINSPACECONTAINER_ID);
+	asc->bheader.ownblock = cpu_to_be32(startblock);
+	asc->previous = cpu_to_be32(sbi->adminlastcontainer);
+	asc->adminspace[0].space = cpu_to_be32(startblock);
+	asc->adminspace[0].bits = cpu_to_be32(0x80000000);
+	asc->bits = 32;
+
+	asfs_bstore(sb, bh);
+	asfs_brelse(bh);
+
+	sbi->adminlastcontainer = startblock;
+	return insertadminarea(sb, startblock, 0x80000000, startblock, 0);
+}
+
+/* number of areas on each side of the goal which are tried before any other */
+#define ASFS_ADMINSPACE_NEAR 8
+
+/* Returns an area with free blocks among the ones closest to /goal/, or NULL. */
+
+static struct asfs_adminarea *nearadminarea(struct asfs_sb_info *sbi, u32 goal)
+{
+	u32 lo = adminareaindex(sbi, goal);
+	u32 i;
+
+	/* areas[lo - 1] is the one holding or preceding the goal */
+	for (i = 0; i < ASFS_ADMINSPACE_NEAR; i++) {
+		if (lo > i && sbi->adminareas[lo - 1 - i].bits != 0xFFFFFFFF)
+			return &sbi->adminareas[lo - 1 - i];
+		if (lo + i < sbi->adminarea_count && sbi->adminareas[lo + i].bits != 0xFFFFFFFF)
+			return &sbi->adminareas[lo + i];
 	}
-	return errorcode;
+	return NULL;
 }
 
-int asfs_freeadminspace(struct super_block *sb, u32 block)
+	/* Allocates one admin block, preferably close to block /goal/ so that
+	   related metadata (a new ObjectContainer and its siblings, a split
+	   B-tree container and its parent) ends up together.  /goal/ can be
+	   zero if there is no preference. */
+
+int asfs_allocadminspace(struct super_block *sb, u32 goal, u32 *returned_block)
 {
-	struct buffer_head *bh;
-	u32 adminspaceblock = ASFS_SB(sb)->adminspacecontainer;
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_adminarea *area;
+	int errorcode;
 
-	asfs_debug("freeadminspace: Entry -- freeing block %d\n", block);
+	asfs_debug("allocadminspace: allocating new block near %u\n", goal);
 
-	while ((bh = asfs_breadcheck(sb, adminspaceblock, ASFS_ADMINSPACECONTAINER_ID))) {
-		struct fsAdminSpaceContainer *asc = (void *) bh->b_data;
-		struct fsAdminSpace *as = asc->adminspace;
-		int adminspaces = (sb->s_blocksize - sizeof(struct fsAdminSpaceContainer)) / sizeof(struct fsAdminSpace);
-
-		while (adminspaces-- > 0) {
-			if (block >= be32_to_cpu(as->space) && block < be32_to_cpu(as->space) + 32) {
-				s16 bitoffset = block - be32_to_cpu(as->space);
-				asfs_debug("freeadminspace: Block to be freed is located in AdminSpaceContainer block at %d\n", adminspaceblock);
-				as->bits &= cpu_to_be32(~(1 << (31 - bitoffset)));
-				asfs_bstore(sb, bh);
-				asfs_brelse(bh);
-				return 0;
+	if (sbi->adminarea_count == 0 && (errorcode = buildadminareas(sb)) != 0)
+		return errorcode;
+
+	for (;;) {
+		area = goal ? nearadminarea(sbi, goal) : NULL;
+
+		/* otherwise the first non-full area from the last one allocated from */
+		if (area == NULL)
+			area = findnonfull(sbi, sbi->adminarea_hint);
+
+		if (area != NULL) {
+			s16 bitoffset = bfffz(area->bits, 0);
+
+			if ((errorcode = setadminbits(sb, area, area->bits | (1 << (31 - bitoffset)))) != 0)
+				return errorcode;
+			sbi->adminarea_hint = area - sbi->adminareas;
+			if (sbi->lastallocatedadminspace != area->container) {
+				sbi->lastallocatedadminspace = area->container;
+				sb->s_dirt = 1;
 			}
-			as++;
+			*returned_block = area->space + bitoffset;
+			asfs_debug("allocadminspace: found block %d\n", *returned_block);
+			return 0;
 		}
 
-		if ((adminspaceblock = be32_to_cpu(asc->next)) == 0)
-			break;
-
-		asfs_brelse(bh);
+		/* all areas are full */
+		if ((errorcode = newadminarea(sb, goal)) != 0)
+			return errorcode;
 	}
+}
 
-	if (bh != NULL) {
-		asfs_brelse(bh);
+int asfs_freeadminspace(struct super_block *sb, u32 block)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_adminarea *area;
+	int errorcode;
+
+	asfs_debug("freeadminspace: Entry -- freeing block %d\n", block);
+
+	if (sbi->adminarea_count == 0 && (errorcode = buildadminareas(sb)) != 0)
+		return errorcode;
+
+	if ((area = findadminarea(sbi, block)) == NULL) {
 		printk("ASFS: Unable to free an administration block. The block cannot be found.");
 		return -ENOENT;
 	}
 
-	return -EIO;
+	asfs_debug("freeadminspace: Block to be freed is located in AdminSpaceContainer block at %d\n", area->container);
+	return setadminbits(sb, area, area->bits & ~(1 << (31 - (block - area->space))));
 }
 
 #endif
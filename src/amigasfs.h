@@ -29,6 +29,8 @@
 #define ASFS_ROOTBITS_CASESENSITIVE (128)
 #define ASFS_READONLY (512)
 #define ASFS_VOL_LOWERCASE (1024)
+#define ASFS_DISCARD (2048)
+#define ASFS_PINBITMAP (4096)
 
 #define ASFS_ROOTNODE   (1)
 #define ASFS_RECYCLEDNODE (2)
@@ -46,6 +48,7 @@
 #define ASFS_ALWAYSFREE (16)		/* keep this amount of blocks free */
 
 #define ASFS_BLOCKCHUNKS (16)		/* try to allocate this number of blocks in one request */
+#define ASFS_MAXBLOCKCHUNK (8192)	/* never add more than this number of blocks in one request */
 
 #ifndef TRUE
 #define TRUE		1
@@ -4,11 +4,14 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
 #include <asm/byteorder.h>
 #include "amigasfs.h"
 
 #define asfs_debug(fmt,arg...) /* no debug at all */
 //#define asfs_debug(fmt,arg...) printk(fmt,##arg)  /* general debug infos */
+//#define ASFS_CHECK_MARKSPACE	/* verify runs with availablespace() before marking them */
 
 #if !defined (__BIG_ENDIAN) && !defined (__LITTLE_ENDIAN)
 #error Endianes must be known for ASFS to work. Sorry.
@@ -18,9 +21,11 @@
 #define ASFS_DEFAULT_UID 0
 #define ASFS_DEFAULT_GID 0
 #define ASFS_DEFAULT_MODE 0644	/* default permission bits for files, dirs have same permission, but with "x" set */
+#define ASFS_DEFAULT_PREALLOC 1024	/* default limit of the per-file preallocation window, in blocks */
+#define ASFS_BITMAP_READAHEAD 32	/* bitmap blocks read ahead of a bitmap scan */
 
 /* Extent structure located in RAM (e.g. inside inode structure), 
-   currently used to store last used extent */
+   used as an entry of the per-inode extent map */
 
 struct inramExtent {
 	u32 startblock;	/* Block from begginig of the file */
@@ -37,7 +42,13 @@ struct asfs_inode_info {
 	u32 hashtable;
 	int modified;
 	loff_t mmu_private;
-	struct inramExtent ext_cache;
+	u32 reserved;			/* blocks reserved for delayed allocation past i_blocks */
+	u32 metareserved;		/* worst case metadata of those, see asfs_metaestimate() */
+	u32 prealloc;			/* preallocation window, doubled on every append */
+	struct inramExtent *ext_map;	/* file extents sorted by startblock, filled lazily */
+	u32 ext_count;			/* number of entries read into ext_map */
+	u32 ext_size;			/* number of entries allocated for ext_map */
+	u32 lastextent;			/* key of the last extent of the file, 0 if not known */
 	struct inode vfs_inode;
 };
 
@@ -47,6 +58,29 @@ static inline struct asfs_inode_info *ASFS_I(struct inode *inode)
    return list_entry(inode, struct asfs_inode_info, vfs_inode);
 }
 
+/* Summary of one fsBitmap block, lets searches skip blocks without
+   reading them.  All counts are in blocks, a bitmap block of 16K or more
+   describes more than 65535 of them. */
+
+struct asfs_bitmapsummary {
+	u32 free;	/* free blocks, ASFS_SUMMARY_UNKNOWN until the block is read */
+	u32 first;	/* first free block */
+	u32 largest;	/* largest run of free blocks */
+	u32 lead;	/* free blocks at the start of the bitmap block */
+	u32 trail;	/* free blocks at the end of the bitmap block */
+};
+
+#define ASFS_SUMMARY_UNKNOWN 0xFFFFFFFF
+
+/* One fsAdminSpace area, as found in the AdminSpaceContainer chain */
+
+struct asfs_adminarea {
+	u32 space;	/* first block of the area */
+	u32 bits;	/* copy of the on-disk bits, set bits are used blocks */
+	u32 container;	/* AdminSpaceContainer holding the fsAdminSpace */
+	u32 slot;	/* index of the fsAdminSpace in the container */
+};
+
 /* Amiga SFS superblock in-core data */
 
 struct asfs_sb_info {
@@ -57,10 +91,38 @@ struct asfs_sb_info {
 
 	u32 adminspacecontainer;
 	u32 bitmapbase;
-	u32 freeblocks;
+	u32 freeblocks;			/* fsRootInfo counters, written back by write_super() */
+	u32 deletedblocks;
+	u32 deletedfiles;
 	u32 blocks_inbitmap;
 	u32 blocks_bitmap;
 	u32 block_rovingblockptr;
+	u32 reservedblocks;		/* blocks reserved by files for delayed allocation, with their metadata */
+	u32 metapool;			/* metadata reserved by the file being allocated */
+	int metaalloc;			/* admin space allocation may use metapool */
+	spinlock_t reserve_lock;	/* freeblocks, reservedblocks, and i_blocks/reserved of the inodes */
+	u32 prealloc_max;		/* limit of the per-file preallocation window */
+	struct rb_root space_bystart;	/* free space index, see spaceindex.c */
+	struct rb_root space_bylen;
+	int space_indexed;
+	int space_noindex;		/* index failed, not rebuilt until remount */
+	struct asfs_bitmapsummary *bitmapsummary;	/* one entry per bitmap block */
+	struct buffer_head **bitmap_bh;	/* pinned bitmap blocks, NULL if not pinned */
+	u8 *bitmap_dirty;		/* pinned bitmap blocks changed since written back */
+	struct asfs_adminarea *adminareas;	/* admin space areas sorted by start block */
+	u32 adminarea_count;
+	u32 adminarea_size;
+	u32 adminarea_hint;		/* area most recently allocated from */
+	u32 *adminnonfull;		/* counts of non-full areas, a tree over the array */
+	u32 adminnonfull_leaves;
+	u32 adminlastcontainer;		/* last AdminSpaceContainer of the chain */
+	u32 lastallocatedadminspace;	/* fsRootInfo hint, container most recently allocated from */
+	struct list_head discards;	/* freed runs waiting to be discarded, see discard.c */
+	struct delayed_work discard_work;
+	struct list_head deferredfrees;	/* extent chains waiting to be freed, see extents.c */
+	struct work_struct free_work;
+	u32 pendingfree;		/* blocks of those chains */
+	struct super_block *sb;
 
 	uid_t uid;
 	gid_t gid;
@@ -143,12 +205,31 @@ static inline void dec_count(struct inode *inode)
 /* all prototypes */
 
 /* adminspace.c */
-int asfs_allocadminspace(struct super_block *sb, u32 * block);
+int asfs_allocadminspace(struct super_block *sb, u32 goal, u32 * block);
 int asfs_freeadminspace(struct super_block *sb, u32 block);
+void asfs_dropadminareas(struct super_block *sb);
 int asfs_markspace(struct super_block *sb, u32 block, u32 blocks);
 int asfs_freespace(struct super_block *sb, u32 block, u32 blocks);
+int asfs_reservespace(struct super_block *sb, u32 blocks);
+u32 asfs_metaestimate(struct super_block *sb, u32 blocks);
+void asfs_unreservespace(struct super_block *sb, u32 blocks);
 int asfs_findspace(struct super_block *sb, u32 maxneeded, u32 start, u32 end,
 	      u32 * returned_block, u32 * returned_blocks);
+void asfs_summarizebitmap(struct super_block *sb, u32 bitmapblock, struct fsBitmap *b);
+int asfs_pinbitmap(struct super_block *sb);
+void asfs_unpinbitmap(struct super_block *sb);
+void asfs_writebitmap(struct super_block *sb);
+struct buffer_head *asfs_getbitmap(struct super_block *sb, u32 bitmapblock);
+void asfs_readaheadbitmap(struct super_block *sb, u32 bitmapblock, u32 count);
+int asfs_writerootinfo(struct super_block *sb);
+int asfs_spacenear(struct super_block *sb, u32 block, u32 blocks);
+
+/* discard.c */
+void asfs_initdiscards(struct super_block *sb);
+void asfs_flushdiscards(struct super_block *sb);
+void asfs_queuediscard(struct super_block *sb, u32 block, u32 blocks);
+void asfs_canceldiscard(struct super_block *sb, u32 block, u32 blocks);
+long asfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
 /* dir.c */
 int asfs_readdir(struct file *filp, void *dirent, filldir_t filldir);
@@ -159,14 +240,23 @@ int asfs_getextent(struct super_block *sb, u32 key, struct buffer_head **ret_bh,
 	      struct fsExtentBNode **ret_ebn);
 int asfs_deletebnode(struct super_block *sb, struct buffer_head *cb, u32 key);
 int asfs_deleteextents(struct super_block *sb, u32 key);
+void asfs_initfrees(struct super_block *sb);
+void asfs_flushfrees(struct super_block *sb);
+int asfs_waitfrees(struct super_block *sb);
+int asfs_deferfree(struct super_block *sb, u32 key, u32 blocks);
 int asfs_addblocks(struct super_block *sb, u16 blocks, u32 newspace,
 	      u32 objectnode, u32 * io_lastextentbnode);
 
 /* file.c */
 int asfs_readpage(struct file *file, struct page *page);
+int asfs_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages);
 sector_t asfs_bmap(struct address_space *mapping, sector_t block);
+ssize_t asfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov, loff_t offset, unsigned long nr_segs);
+int asfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len);
 int asfs_writepage(struct page *page, struct writeback_control *wbc);
+int asfs_writepages(struct address_space *mapping, struct writeback_control *wbc);
 int asfs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata);
+long asfs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len);
 void asfs_truncate(struct inode *inode);
 int asfs_file_open(struct inode *inode, struct file *filp);
 int asfs_file_release(struct inode *inode, struct file *filp);
@@ -199,16 +289,24 @@ int asfs_createobject(struct super_block *sb, struct buffer_head **io_cb,
 		 struct fsObject **io_o, struct fsObject *src_o,
 		 u8 * objname, int force);
 int asfs_deleteobject(struct super_block *sb, struct buffer_head *cb,
-		 struct fsObject *o);
+		 struct fsObject *o, u32 blocks);
 int asfs_renameobject(struct super_block *sb, struct buffer_head *cb1,
 		 struct fsObject *o1, struct buffer_head *cbparent,
 		 struct fsObject *oparent, u8 * newname);
 
 int asfs_addblockstofile(struct super_block *sb, struct buffer_head *objcb,
-		    struct fsObject *o, u32 blocks, u32 * newspace,
-		    u32 * addedblocks);
+		    struct fsObject *o, u32 blocks, u32 * io_lastextentbnode,
+		    u32 * newspace, u32 * addedblocks);
 int asfs_truncateblocksinfile(struct super_block *sb, struct buffer_head *bh,
-			 struct fsObject *o, u32 newsize);
+			 struct fsObject *o, u32 newsize, u32 blocks);
+
+/* spaceindex.c */
+int asfs_buildspaceindex(struct super_block *sb);
+void asfs_dropspaceindex(struct super_block *sb);
+int asfs_searchspaceindex(struct super_block *sb, u32 maxneeded, u32 goal,
+		     u32 * returned_block, u32 * returned_blocks);
+void asfs_markspaceindex(struct super_block *sb, u32 block, u32 blocks);
+void asfs_freespaceindex(struct super_block *sb, u32 block, u32 blocks);
 
 /* symlink.c */
 int asfs_symlink_readpage(struct file *file, struct page *page);
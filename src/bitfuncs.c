@@ -9,13 +9,46 @@
 
 #include <linux/types.h>
 #include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
 #include "bitfuncs.h"
 
 /* Bitmap (bm) functions:
    These functions perform bit-operations on regions of memory which
    are a multiple of 4 bytes in length. Bitmap is in bigendian byte order.
+   Spans of all-free or all-used longs are skipped 64 bits at a time and
+   filled with memset, only the longs at the edges are byte swapped.
 */
 
+/* Returns how many longs from /scan/ on, at most /longs/, are equal to
+   /fill/.  Comparing with 0 or 0xFFFFFFFF doesn't depend on the byte
+   order, so whole 64-bit words are compared once /scan/ is aligned. */
+
+static inline int bmskip(u32 *scan, int longs, u32 fill)
+{
+	u32 *p = scan, *end = scan + longs;
+	u64 fill64 = ((u64) fill << 32) | fill;
+
+	if (longs <= 0)
+		return 0;
+
+	if (((unsigned long) p & 7) != 0) {
+		if (*p != fill)
+			return 0;
+		p++;
+	}
+
+	while (end - p >= 8 && ((u64 *) p)[0] == fill64 && ((u64 *) p)[1] == fill64 &&
+	       ((u64 *) p)[2] == fill64 && ((u64 *) p)[3] == fill64)
+		p += 8;
+	while (end - p >= 2 && *(u64 *) p == fill64)
+		p += 2;
+	while (p < end && *p == fill)
+		p++;
+
+	return p - scan;
+}
+
 /* This function finds the first set bit in a region of memory starting
    with /bitoffset/.  The region of memory is /longs/ longs long.  It
    returns the bitoffset of the first set bit it finds. */
@@ -39,10 +72,10 @@ int bmffo(u32 *bitmap, int longs, int bitoffset)
 		longs--;
 	}
 
-	while (longs-- > 0) {
-		if (*scan++ != 0) {
-			return (bfffo(be32_to_cpu(*--scan), 0) + ((scan - bitmap) << 5));
-		}
+	longoffset = bmskip(scan, longs, 0);
+	if (longoffset < longs) {
+		scan += longoffset;
+		return (bfffo(be32_to_cpu(*scan), 0) + ((scan - bitmap) << 5));
 	}
 
 	return (-1);
@@ -71,10 +104,10 @@ int bmffz(u32 *bitmap, int longs, int bitoffset)
 		longs--;
 	}
 
-	while (longs-- > 0) {
-		if (*scan++ != 0xFFFFFFFF) {
-			return (bfffz(be32_to_cpu(*--scan), 0) + ((scan - bitmap) << 5));
-		}
+	longoffset = bmskip(scan, longs, 0xFFFFFFFF);
+	if (longoffset < longs) {
+		scan += longoffset;
+		return (bfffz(be32_to_cpu(*scan), 0) + ((scan - bitmap) << 5));
 	}
 
 	return (-1);
@@ -110,13 +143,17 @@ int bmclr(u32 *bitmap, int longs, int bitoffset, int bits)
 		bits -= 32 - bitoffset;
 	}
 
-	while (bits > 0 && longs-- > 0) {
-		if (bits > 31) {
-			*scan++ = 0;
-		} else {
-			*scan = cpu_to_be32(bfclr(be32_to_cpu(*scan), 0, bits));
-		}
-		bits -= 32;
+	if (bits > 31 && longs > 0) {
+		longoffset = min(bits >> 5, longs);
+		memset(scan, 0, longoffset << 2);
+		scan += longoffset;
+		longs -= longoffset;
+		bits -= longoffset << 5;
+	}
+
+	if (bits > 0 && longs > 0) {
+		*scan = cpu_to_be32(bfclr(be32_to_cpu(*scan), 0, bits));
+		bits = 0;
 	}
 
 	if (bits <= 0) {
@@ -155,13 +192,17 @@ int bmset(u32 *bitmap, int longs, int bitoffset, int bits)
 		bits -= 32 - bitoffset;
 	}
 
-	while (bits > 0 && longs-- > 0) {
-		if (bits > 31) {
-			*scan++ = 0xFFFFFFFF;
-		} else {
-			*scan = cpu_to_be32(bfset(be32_to_cpu(*scan), 0, bits));
-		}
-		bits -= 32;
+	if (bits > 31 && longs > 0) {
+		longoffset = min(bits >> 5, longs);
+		memset(scan, 0xFF, longoffset << 2);
+		scan += longoffset;
+		longs -= longoffset;
+		bits -= longoffset << 5;
+	}
+
+	if (bits > 0 && longs > 0) {
+		*scan = cpu_to_be32(bfset(be32_to_cpu(*scan), 0, bits));
+		bits = 0;
 	}
 
 	if (bits <= 0) {
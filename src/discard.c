@@ -0,0 +1,333 @@
+/*
+ *
+ * Amiga Smart File System, Linux implementation
+ * version: 1.0beta13
+ *
+ * Discarding free space: the FITRIM ioctl and the "discard" mount option.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/capability.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include "asfs_fs.h"
+#include "bitfuncs.h"
+
+#include <asm/byteorder.h>
+#include <asm/uaccess.h>
+
+#ifdef CONFIG_ASFS_RW
+
+/* With the "discard" mount option, runs freed by asfs_freespace() are
+   queued and discarded together a moment later, adjacent runs merged into
+   one request.  Blocks allocated again before that are taken off the queue
+   by asfs_markspace().  The queue is only touched under lock_super(). */
+
+struct asfs_discard {
+	struct list_head list;
+	u32 block;
+	u32 blocks;
+};
+
+#define ASFS_DISCARD_DELAY HZ
+#define ASFS_DISCARD_BATCH 16
+
+/* Issues up to /count/ queued discards.  The queue is worked through a
+   batch per lock_super() hold, so allocations don't wait for a long queue
+   to be discarded, while the runs of a batch still can't be allocated
+   before they are discarded. */
+
+static void issuediscards(struct super_block *sb, int count)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_discard *d, *n;
+
+	list_for_each_entry_safe(d, n, &sbi->discards, list) {
+		if (count-- <= 0)
+			break;
+		asfs_debug("issuediscards: %u blocks from block %u\n", d->blocks, d->block);
+		sb_issue_discard(sb, d->block, d->blocks, GFP_NOFS, 0);
+		list_del(&d->list);
+		kfree(d);
+	}
+}
+
+static void issueall(struct super_block *sb)
+{
+	lock_super(sb);
+	while (!list_empty(&ASFS_SB(sb)->discards)) {
+		issuediscards(sb, ASFS_DISCARD_BATCH);
+		unlock_super(sb);
+		cond_resched();
+		lock_super(sb);
+	}
+	unlock_super(sb);
+}
+
+static void asfs_discardwork(struct work_struct *work)
+{
+	struct asfs_sb_info *sbi = container_of(work, struct asfs_sb_info, discard_work.work);
+
+	issueall(sbi->sb);
+}
+
+void asfs_initdiscards(struct super_block *sb)
+{
+	ASFS_SB(sb)->sb = sb;
+	INIT_LIST_HEAD(&ASFS_SB(sb)->discards);
+	INIT_DELAYED_WORK(&ASFS_SB(sb)->discard_work, asfs_discardwork);
+}
+
+/* Issues everything still queued, used on unmount and remount. */
+
+void asfs_flushdiscards(struct super_block *sb)
+{
+	cancel_delayed_work_sync(&ASFS_SB(sb)->discard_work);
+	issueall(sb);
+}
+
+void asfs_queuediscard(struct super_block *sb, u32 block, u32 blocks)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_discard *d;
+
+	if (!list_empty(&sbi->discards)) {
+		d = list_entry(sbi->discards.prev, struct asfs_discard, list);
+		if (d->block + d->blocks == block) {
+			d->blocks += blocks;
+			return;
+		}
+		if (block + blocks == d->block) {
+			d->block = block;
+			d->blocks += blocks;
+			return;
+		}
+	}
+
+	/* discards are only hints, nothing is lost without memory */
+	if (!(d = kmalloc(sizeof(struct asfs_discard), GFP_NOFS)))
+		return;
+
+	d->block = block;
+	d->blocks = blocks;
+	list_add_tail(&d->list, &sbi->discards);
+	schedule_delayed_work(&sbi->discard_work, ASFS_DISCARD_DELAY);
+}
+
+/* Takes blocks which are being allocated off the queue. */
+
+void asfs_canceldiscard(struct super_block *sb, u32 block, u32 blocks)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_discard *d, *n;
+	u32 end = block + blocks;
+
+	list_for_each_entry_safe(d, n, &sbi->discards, list) {
+		u32 dend = d->block + d->blocks;
+
+		if (dend <= block || d->block >= end)
+			continue;
+
+		if (d->block < block && dend > end) {
+			struct asfs_discard *tail;
+
+			if ((tail = kmalloc(sizeof(struct asfs_discard), GFP_NOFS))) {
+				tail->block = end;
+				tail->blocks = dend - end;
+				list_add(&tail->list, &d->list);
+			}
+			d->blocks = block - d->block;
+		} else if (d->block < block)
+			d->blocks = block - d->block;
+		else if (dend > end) {
+			d->block = end;
+			d->blocks = dend - end;
+		} else {
+			list_del(&d->list);
+			kfree(d);
+		}
+	}
+}
+
+static int trimrun(struct super_block *sb, u32 block, u32 blocks, u64 * trimmed)
+{
+	int error;
+
+	if (blocks == 0)
+		return 0;
+	if ((error = sb_issue_discard(sb, block, blocks, GFP_NOFS, 0)) == 0)
+		*trimmed += blocks;
+	return error;
+}
+
+/* Discards the free runs of at least /minlen/ blocks found in the bitmap
+   between blocks /start/ and /end/.  Runs are joined across bitmap
+   blocks.  lock_super() is held from one bitmap block to the next while
+   a run reaching the end of a bitmap block is still shorter than
+   /minlen/, otherwise it is dropped between bitmap blocks.  A long run
+   reaching the end of a bitmap block is discarded up to there and the
+   rest of it is discarded whatever its length, so nothing is allocated
+   from a run while it is being discarded.  Bitmap blocks whose summary
+   shows no run long enough are not read at all. */
+
+static int trimfs(struct super_block *sb, u32 start, u32 end, u32 minlen, u64 * trimmed)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	u32 bits = sbi->blocks_inbitmap;
+	u32 longs = bits >> 5;
+	u32 runstart = 0, runblocks = 0;
+	int runlong = FALSE;		/* the run started before runstart was discarded */
+	int locked = FALSE;
+	u32 i;
+	int error = 0;
+
+	for (i = start / bits; i < sbi->blocks_bitmap && i * bits < end && error == 0; i++) {
+		struct asfs_bitmapsummary *sum = sbi->bitmapsummary ? &sbi->bitmapsummary[i] : NULL;
+		u32 base = i * bits;
+		struct buffer_head *bh;
+		struct fsBitmap *b;
+		int bitstart, bitend;
+
+		if ((i - start / bits) % ASFS_BITMAP_READAHEAD == 0)
+			asfs_readaheadbitmap(sb, sbi->bitmapbase + i, ASFS_BITMAP_READAHEAD);
+
+		if (!locked) {
+			lock_super(sb);
+			locked = TRUE;
+
+			/* runs may continue from the previous block and into the next */
+			if (sum && sum->free != ASFS_SUMMARY_UNKNOWN && sum->largest < minlen &&
+			    sum->trail == 0 && (!runlong || sum->lead == 0)) {
+				unlock_super(sb);
+				locked = FALSE;
+				runlong = FALSE;
+				continue;
+			}
+		}
+
+		if (!(bh = asfs_getbitmap(sb, sbi->bitmapbase + i))) {
+			error = -EIO;
+			break;
+		}
+		b = (void *) bh->b_data;
+		if (sum && sum->free == ASFS_SUMMARY_UNKNOWN)
+			asfs_summarizebitmap(sb, sbi->bitmapbase + i, b);
+
+		bitend = start > base ? start - base : 0;
+		while (error == 0 && bitend < bits && (bitstart = bmffo(b->bitmap, longs, bitend)) >= 0) {
+			u32 runend;
+
+			if ((bitend = bmffz(b->bitmap, longs, bitstart)) < 0)
+				bitend = bits;
+			if (base + bitstart >= end)
+				break;
+
+			/* the last bitmap block may describe blocks past the end */
+			runend = min(base + bitend, end);
+			if ((runblocks != 0 || runlong) && runstart + runblocks == base + bitstart)
+				runblocks += runend - (base + bitstart);
+			else {
+				if (runlong || runblocks >= minlen)
+					error = trimrun(sb, runstart, runblocks, trimmed);
+				runlong = FALSE;
+				runstart = base + bitstart;
+				runblocks = runend - runstart;
+			}
+		}
+		asfs_brelse(bh);
+
+		if (error)
+			break;
+
+		if (runstart + runblocks < base + bits) {
+			/* the run ended inside this block */
+			if (runlong || runblocks >= minlen)
+				error = trimrun(sb, runstart, runblocks, trimmed);
+			runlong = FALSE;
+			runblocks = 0;
+		} else if (runlong || runblocks >= minlen) {
+			/* long enough already, the rest follows in the next block */
+			error = trimrun(sb, runstart, runblocks, trimmed);
+			runlong = TRUE;
+			runstart += runblocks;
+			runblocks = 0;
+		} else if (runblocks != 0)
+			continue;	/* keep the lock, the run may still grow */
+
+		unlock_super(sb);
+		locked = FALSE;
+
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+
+	if (locked)
+		unlock_super(sb);
+
+	return error;
+}
+
+static int asfs_fitrim(struct super_block *sb, struct fstrim_range __user *arg)
+{
+	struct fstrim_range range;
+	u64 start, end, minlen, trimmed = 0;
+	int error;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!blk_queue_discard(bdev_get_queue(sb->s_bdev)))
+		return -EOPNOTSUPP;
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	start = range.start >> sb->s_blocksize_bits;
+	end = start + (range.len >> sb->s_blocksize_bits);
+	minlen = range.minlen >> sb->s_blocksize_bits;
+
+	if (end < start || end > ASFS_SB(sb)->totalblocks)
+		end = ASFS_SB(sb)->totalblocks;
+	if (minlen == 0)
+		minlen = 1;
+	if (minlen > ASFS_SB(sb)->totalblocks)
+		minlen = ASFS_SB(sb)->totalblocks;
+
+	asfs_debug("ASFS: fitrim (blocks %llu to %llu, minlen %llu)\n", start, end, minlen);
+
+	if (start < end)
+		if ((error = trimfs(sb, start, end, minlen, &trimmed)) != 0)
+			return error;
+
+	range.len = trimmed << sb->s_blocksize_bits;
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+
+	return 0;
+}
+
+long asfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = filp->f_path.dentry->d_sb;
+
+	switch (cmd) {
+	case FITRIM:
+		return asfs_fitrim(sb, (struct fstrim_range __user *) arg);
+	}
+
+	return -ENOTTY;
+}
+
+#endif
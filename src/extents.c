@@ -19,6 +19,8 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/vfs.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
 #include "asfs_fs.h"
 
 #include <asm/byteorder.h>
@@ -182,7 +184,7 @@ static int splitbtreecontainer(struct super_block *sb, struct buffer_head *bh)
 			asfs_debug("splitbtreecontainer: creating root tree-container.\n");
 
 			bhparent = bh;
-			if ((errorcode = asfs_allocadminspace(sb, &newbcontblock)) == 0 && (bh = asfs_getzeroblk(sb, newbcontblock))) {
+			if ((errorcode = asfs_allocadminspace(sb, bhparent->b_blocknr, &newbcontblock)) == 0 && (bh = asfs_getzeroblk(sb, newbcontblock))) {
 				struct fsBNodeContainer *bnc = (void *) bh->b_data;
 				struct fsBNodeContainer *bncparent = (void *) bhparent->b_data;
 				struct BTreeContainer *btcparent = &bncparent->btc;
@@ -231,7 +233,8 @@ static int splitbtreecontainer(struct super_block *sb, struct buffer_head *bh)
 				/* We can split this container and add it to the parent
 				   because the parent has enough room. */
 
-				if ((errorcode = asfs_allocadminspace(sb, &newbcontblock)) == 0 && (bhnew = asfs_getzeroblk(sb, newbcontblock))) {
+				/* the new container goes next to its parent */
+				if ((errorcode = asfs_allocadminspace(sb, bhparent->b_blocknr, &newbcontblock)) == 0 && (bhnew = asfs_getzeroblk(sb, newbcontblock))) {
 					struct fsBNodeContainer *bncnew = (void *) bhnew->b_data;
 					struct BTreeContainer *btcnew = &bncnew->btc;
 					struct fsBNodeContainer *bnc = (void *) bh->b_data;
@@ -499,6 +502,145 @@ int asfs_deleteextents(struct super_block *sb, u32 key)
 	return (errorcode);
 }
 
+/* Extent chains of deleted and truncated files are freed in the
+   background, so that unlink doesn't have to walk a chain of thousands of
+   extents.  The chain is detached from its object first and queued here,
+   the worker frees ASFS_FREE_BATCH extents per lock_super() hold.  Until
+   then its blocks are counted in pendingfree, which statfs() reports as
+   free and allocators wait for before giving up with ENOSPC.  The queue
+   is only touched under lock_super(). */
+
+struct asfs_deferredfree {
+	struct list_head list;
+	u32 key;	/* next extent to free */
+	u32 blocks;	/* blocks of the chain still counted in pendingfree */
+};
+
+#define ASFS_FREE_BATCH 64
+
+/* Frees up to /count/ extents of the first queued chain. */
+
+static int freedeferred(struct super_block *sb, int count)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_deferredfree *df;
+	struct buffer_head *bh;
+	struct fsExtentBNode *ebn;
+	int errorcode = 0;
+
+	if (list_empty(&sbi->deferredfrees))
+		return 0;
+	df = list_entry(sbi->deferredfrees.next, struct asfs_deferredfree, list);
+
+	while (count-- > 0 && df->key != 0 && (errorcode = findbnode(sb, df->key, &bh, (struct BNode **) &ebn)) == 0) {
+		u32 blocks = be16_to_cpu(ebn->blocks);
+
+		df->key = be32_to_cpu(ebn->next);
+		if ((errorcode = asfs_freespace(sb, be32_to_cpu(ebn->key), blocks)) == 0)
+			errorcode = asfs_deletebnode(sb, bh, be32_to_cpu(ebn->key));
+		asfs_brelse(bh);
+		if (errorcode)
+			break;
+
+		blocks = min(blocks, df->blocks);
+		df->blocks -= blocks;
+		sbi->pendingfree -= blocks;
+	}
+
+	if (errorcode)
+		printk(KERN_ERR "ASFS: Error %d while freeing the extents of a deleted file, some blocks are lost\n", errorcode);
+
+	if (df->key == 0 || errorcode) {
+		sbi->pendingfree -= df->blocks;
+		list_del(&df->list);
+		kfree(df);
+	}
+
+	return errorcode;
+}
+
+static void asfs_freework(struct work_struct *work)
+{
+	struct asfs_sb_info *sbi = container_of(work, struct asfs_sb_info, free_work);
+
+	lock_super(sbi->sb);
+	while (!list_empty(&sbi->deferredfrees)) {
+		freedeferred(sbi->sb, ASFS_FREE_BATCH);
+		unlock_super(sbi->sb);
+		cond_resched();
+		lock_super(sbi->sb);
+	}
+	unlock_super(sbi->sb);
+}
+
+void asfs_initfrees(struct super_block *sb)
+{
+	INIT_LIST_HEAD(&ASFS_SB(sb)->deferredfrees);
+	INIT_WORK(&ASFS_SB(sb)->free_work, asfs_freework);
+}
+
+/* Frees everything still queued, used on unmount and remount. */
+
+void asfs_flushfrees(struct super_block *sb)
+{
+	cancel_work_sync(&ASFS_SB(sb)->free_work);
+	lock_super(sb);
+	while (!list_empty(&ASFS_SB(sb)->deferredfrees))
+		freedeferred(sb, ASFS_FREE_BATCH);
+	unlock_super(sb);
+}
+
+/* Waits for the worker if there are blocks on their way back.  Returns
+   TRUE if it is worth trying an allocation which failed again.  Must be
+   called without lock_super(). */
+
+int asfs_waitfrees(struct super_block *sb)
+{
+	if (ASFS_SB(sb)->pendingfree == 0)
+		return FALSE;
+
+	flush_work(&ASFS_SB(sb)->free_work);
+	return TRUE;
+}
+
+/* Queues the extent chain starting at /key/, which must already be
+   detached from its object.  /blocks/ is how many blocks the chain is
+   expected to hold. */
+
+int asfs_deferfree(struct super_block *sb, u32 key, u32 blocks)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_deferredfree *df;
+
+	if (key == 0)
+		return 0;
+
+	/* without memory the chain is freed right away */
+	if (!(df = kmalloc(sizeof(struct asfs_deferredfree), GFP_NOFS)))
+		return asfs_deleteextents(sb, key);
+
+	asfs_debug("deferfree: queueing extents from key %u (%u blocks)\n", key, blocks);
+
+	df->key = key;
+	df->blocks = blocks;
+	list_add_tail(&df->list, &sbi->deferredfrees);
+	sbi->pendingfree += blocks;
+	schedule_work(&sbi->free_work);
+
+	return 0;
+}
+
+/* The roving pointer is where new files start looking for space, it is
+   stored in fsRootInfo and so survives remounts. */
+
+static void setrovingptr(struct super_block *sb, u32 block)
+{
+	if (block >= ASFS_SB(sb)->totalblocks)
+		block = 0;
+	ASFS_SB(sb)->block_rovingblockptr = block;
+	sb->s_dirt = 1;
+}
+
    /* This function adds /blocks/ blocks starting at block /newspace/ to a file
       identified by /objectnode/ and /lastextentbnode/.  /io_lastextentbnode/ can
       be zero if there is no ExtentBNode chain attached to this file yet.
@@ -549,11 +691,7 @@ int asfs_addblocks(struct super_block *sb, u16 blocks, u32 newspace, u32 objectn
 					asfs_bstore(sb, bh);
 					asfs_brelse(bh);
 
-					ASFS_SB(sb)->block_rovingblockptr = newspace + blocks;
-
-	/* to be changed in the future */
-/*					if (ASFS_SB(sb)->block_rovingblockptr >= ASFS_SB(sb)->totalblocks)
-						ASFS_SB(sb)->block_rovingblockptr = 0;*/
+					setrovingptr(sb, newspace + blocks);
 				}
 			}
 		}
@@ -572,10 +710,7 @@ int asfs_addblocks(struct super_block *sb, u16 blocks, u32 newspace, u32 objectn
 			asfs_bstore(sb, bh);
 			asfs_brelse(bh);
 
-			ASFS_SB(sb)->block_rovingblockptr = newspace + blocks;
-
-/*			if (ASFS_SB(sb)->block_rovingblockptr >= ASFS_SB(sb)->totalblocks)
-				ASFS_SB(sb)->block_rovingblockptr = 0;*/
+			setrovingptr(sb, newspace + blocks);
 		}
 	}
 
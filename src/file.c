@@ -19,32 +19,274 @@
 #include <linux/fs.h>
 #include <linux/pagemap.h>
 #include <linux/buffer_head.h>
+#include <linux/mpage.h>
+#include <linux/falloc.h>
+#include <linux/pagevec.h>
+#include <linux/writeback.h>
 #include <linux/vfs.h>
 #include "asfs_fs.h"
 
 #include <asm/byteorder.h>
 
-static int
-asfs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh_result, int create)
+/* Per-inode extent map.  Extents are appended to the map while the file's
+   fsExtentBNode chain is walked, so every chain extent is read from disk
+   at most once and mapping a block is a binary search.  The map is only
+   accessed under lock_super(). */
+
+static int asfs_extmap_add(struct inode *inode, u32 startblock, u32 key, u32 next, u16 blocks)
+{
+	struct asfs_inode_info *ai = ASFS_I(inode);
+	struct inramExtent *ext;
+
+	if (ai->ext_count == ai->ext_size) {
+		u32 size = ai->ext_size ? ai->ext_size * 2 : 8;
+
+		if (!(ext = krealloc(ai->ext_map, size * sizeof(struct inramExtent), GFP_NOFS)))
+			return -ENOMEM;
+		ai->ext_map = ext;
+		ai->ext_size = size;
+	}
+
+	ext = &ai->ext_map[ai->ext_count++];
+	ext->startblock = startblock;
+	ext->key = key;
+	ext->next = next;
+	ext->blocks = blocks;
+
+	return 0;
+}
+
+/* Reads extents from the chain into the map, starting after the last
+   mapped one, until file block /block/ is covered or the chain ends. */
+
+static int asfs_extmap_fill(struct inode *inode, u32 block)
 {
+	struct asfs_inode_info *ai = ASFS_I(inode);
 	struct buffer_head *ebn_bh;
-	struct fsExtentBNode extent, *ebn_p;
-	u32 filedata;
-	unsigned long pos;
-	struct super_block *sb = inode->i_sb;
-#ifdef CONFIG_ASFS_RW
+	struct fsExtentBNode *ebn_p;
+	u32 key, pos;
+	int error;
+
+	if (ai->ext_count == 0) {
+		key = ai->firstblock;
+		pos = 0;
+	} else {
+		struct inramExtent *last = &ai->ext_map[ai->ext_count - 1];
+		key = last->next;
+		pos = last->startblock + last->blocks;
+	}
+
+	while (key != 0 && pos <= block) {
+		if (asfs_getextent(inode->i_sb, key, &ebn_bh, &ebn_p) != 0)
+			return -EIO;
+		error = asfs_extmap_add(inode, pos, be32_to_cpu(ebn_p->key), be32_to_cpu(ebn_p->next), be16_to_cpu(ebn_p->blocks));
+		pos += be16_to_cpu(ebn_p->blocks);
+		key = be32_to_cpu(ebn_p->next);
+		asfs_brelse(ebn_bh);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+/* Finds the map entry holding file block /block/. */
+
+static int asfs_extmap_find(struct inode *inode, u32 block, struct inramExtent **ret_ext)
+{
+	struct asfs_inode_info *ai = ASFS_I(inode);
+	struct inramExtent *ext;
+	u32 lo = 0, hi;
 	int error;
+
+	if (ai->ext_count == 0 || ai->ext_map[ai->ext_count - 1].startblock + ai->ext_map[ai->ext_count - 1].blocks <= block)
+		if ((error = asfs_extmap_fill(inode, block)) != 0)
+			return error;
+
+	hi = ai->ext_count;
+	while (lo < hi) {
+		u32 mid = (lo + hi) / 2;
+
+		ext = &ai->ext_map[mid];
+		if (block < ext->startblock)
+			hi = mid;
+		else if (block >= ext->startblock + ext->blocks)
+			lo = mid + 1;
+		else {
+			*ret_ext = ext;
+			return 0;
+		}
+	}
+
+	printk(KERN_ERR "ASFS: Extent chain of node %lu does not cover block %u!\n", inode->i_ino, block);
+	return -EIO;
+}
+
+#ifdef CONFIG_ASFS_RW
+
+/* Updates the map after asfs_addblockstofile() has appended /blocks/ blocks
+   starting at disk block /newspace/ to the chain.  The last extent is
+   extended exactly when asfs_addblocks() extends it on disk.  If the map
+   does not reach the end of the chain yet, nothing needs to be done, the
+   new extent will be read together with the rest of the chain. */
+
+static void asfs_extmap_append(struct inode *inode, u32 newspace, u32 blocks)
+{
+	struct asfs_inode_info *ai = ASFS_I(inode);
+	struct inramExtent *last;
+
+	if (ai->ext_count == 0) {
+		if (ai->firstblock == 0)
+			asfs_extmap_add(inode, 0, newspace, 0, blocks);
+		return;
+	}
+
+	last = &ai->ext_map[ai->ext_count - 1];
+	if (last->next != 0)
+		return;
+
+	if (last->key + last->blocks == newspace && last->blocks + blocks < 65536)
+		last->blocks += blocks;
+	else {
+		last->next = newspace;
+		asfs_extmap_add(inode, last->startblock + last->blocks, newspace, 0, blocks);
+	}
+}
+
+/* Drops everything past file block /blocks/ from the map, the same way
+   asfs_truncateblocksinfile() cuts the chain on disk. */
+
+static void asfs_extmap_truncate(struct inode *inode, u32 blocks)
+{
+	struct asfs_inode_info *ai = ASFS_I(inode);
+
+	while (ai->ext_count > 0) {
+		struct inramExtent *ext = &ai->ext_map[ai->ext_count - 1];
+
+		if (ext->startblock < blocks) {
+			if (ext->startblock + ext->blocks >= blocks) {
+				ext->blocks = blocks - ext->startblock;
+				ext->next = 0;
+			}
+			break;
+		}
+		ai->ext_count--;
+	}
+}
+
+/* Allocates blocks at the end of the file until it has /end/ blocks.  The
+   object is read once for the whole run and every asfs_findspace() call
+   is asked for as much of it as one request may add, so a large write
+   costs a few allocations instead of one per chunk.  With /window/ set,
+   the file's preallocation window is allocated on top.  Reservations
+   below /end/ are given back first so the allocator can use the space,
+   and the metadata reserved with them is what new admin space areas are
+   taken from.  Called under lock_super().
+
+   Writers reserving blocks under reserve_lock only look at i_blocks +
+   reserved, so the file's reservation shrinks only as blocks are added
+   and that sum never goes down.  What was given back to the allocator but
+   not used, or used but not given back, is settled at the end. */
+
+static int asfs_extendfile(struct inode *inode, u32 end, int window)
+{
+	struct super_block *sb = inode->i_sb;
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_inode_info *ai = ASFS_I(inode);
 	struct buffer_head *bh;
 	struct fsObject *obj;
+	u32 released, used = 0;
+	int error;
+
+	spin_lock(&sbi->reserve_lock);
+	released = min(ai->reserved, end - (u32) inode->i_blocks);
+	asfs_unreservespace(sb, released);
+	spin_unlock(&sbi->reserve_lock);
+
+	if ((error = asfs_readobject(sb, inode->i_ino, &bh, &obj)) != 0) {
+		spin_lock(&sbi->reserve_lock);
+		sbi->reservedblocks += released;
+		spin_unlock(&sbi->reserve_lock);
+		return error;
+	}
+
+	/* new admin space areas may use the metadata reserved by the file */
+	spin_lock(&sbi->reserve_lock);
+	sbi->metapool = ai->metareserved;
+	ai->metareserved = 0;
+	spin_unlock(&sbi->reserve_lock);
+
+	ai->modified = TRUE;
+
+	/* asfs_findspace() may return shorter runs than asked for */
+	while (inode->i_blocks < end) {
+		u32 blockstoadd = end - inode->i_blocks;
+		u32 newspace, addedblocks, covered;
+
+		if (window && blockstoadd < ai->prealloc)
+			blockstoadd = ai->prealloc;
+		if (blockstoadd > ASFS_MAXBLOCKCHUNK)
+			blockstoadd = ASFS_MAXBLOCKCHUNK;
+
+		asfs_debug("ASFS: extendfile: Trying to add %u blocks to file\n", blockstoadd);
+
+		error = asfs_addblockstofile(sb, bh, obj, blockstoadd, &ai->lastextent, &newspace, &addedblocks);
+		if (error == -ENOSPC && blockstoadd > end - inode->i_blocks) {
+			/* no room for the window, allocate just what is needed */
+			ai->prealloc = 1;
+			continue;
+		}
+		if (error)
+			break;
+		if (window && ai->prealloc < ASFS_SB(sb)->prealloc_max)
+			ai->prealloc = min(ai->prealloc * 2, ASFS_SB(sb)->prealloc_max);
+		asfs_extmap_append(inode, newspace, addedblocks);
+		ai->firstblock = be32_to_cpu(obj->object.file.data);
+
+		spin_lock(&sbi->reserve_lock);
+		inode->i_blocks += addedblocks;
+		covered = min(ai->reserved, addedblocks);
+		ai->reserved -= covered;
+		used += covered;
+		spin_unlock(&sbi->reserve_lock);
+	}
+	asfs_brelse(bh);
+
+	spin_lock(&sbi->reserve_lock);
+	sbi->reservedblocks += released - used;
+	/* the unused part of the pool is replaced by what the blocks still
+	   reserved need */
+	sbi->reservedblocks -= sbi->metapool;
+	sbi->metapool = 0;
+	ai->metareserved = asfs_metaestimate(sb, ai->reserved);
+	sbi->reservedblocks += ai->metareserved;
+	spin_unlock(&sbi->reserve_lock);
+
+	return error;
+}
+
 #endif
 
-	asfs_debug("ASFS: get_block(%lu, %ld, %d)\n", inode->i_ino, block, create);
+/* Maps file block /block/ to a run of disk blocks, answering straight from
+   the extent map.  This is the single entry point through which every
+   data path (page cache reads, writes and writeback, bmap) looks up the
+   SFS extents.  At most /maxblocks/ blocks of one extent are mapped, the
+   first disk block is returned through /pblock/ and /new/ is set if the
+   blocks have just been allocated.  Returns the number of mapped blocks
+   or a negative error code. */
 
-	if (block < 0) {
-		printk(KERN_ERR "ASFS: asfsget_block: requested block (%ld) < 0!\n", block);
-		return -EIO;
-	} else if (block >= inode->i_blocks && !create) {
-		printk(KERN_ERR "ASFS: asfsget_block: strange block request %ld!\n", block);
+static int asfs_map_blocks(struct inode *inode, u32 block, u32 maxblocks, int create, u32 *pblock, int *new)
+{
+	struct inramExtent *ext;
+	struct super_block *sb = inode->i_sb;
+	u32 blocks;
+	int error;
+#ifdef CONFIG_ASFS_RW
+	int extend = create;
+#endif
+
+	if (block >= inode->i_blocks && !create) {
+		printk(KERN_ERR "ASFS: asfsget_block: strange block request %u!\n", block);
 		return -EIO;
 	} 
 
@@ -62,80 +304,90 @@ asfs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh_resul
 
 #ifdef CONFIG_ASFS_RW
 	if (create) {
-		int blockstoadd;
-		u32 newspace, addedblocks;
+		u32 end = block + maxblocks;
 
-		blockstoadd = block - inode->i_blocks + 1;
+		/* blocks reserved by write_begin are allocated together with
+		   the requested ones */
+		if (end < inode->i_blocks + ASFS_I(inode)->reserved)
+			end = inode->i_blocks + ASFS_I(inode)->reserved;
 
-		if (blockstoadd < ASFS_BLOCKCHUNKS)
-			blockstoadd = ASFS_BLOCKCHUNKS;
- 
-		asfs_debug("ASFS get_block: Trying to add %d blocks to file\n", blockstoadd);
-		
-		if ((error = asfs_readobject(sb, inode->i_ino, &bh, &obj)) != 0) {
+		if ((error = asfs_extendfile(inode, end, TRUE)) == -ENOSPC) {
+			/* blocks of deleted files may still be on their way back */
 			unlock_super(sb);
-			return error;
+			if (!asfs_waitfrees(sb))
+				return error;
+			lock_super(sb);
+			error = asfs_extendfile(inode, end, TRUE);
 		}
-
-		if ((error = asfs_addblockstofile(sb, bh, obj, blockstoadd, &newspace, &addedblocks)) != 0) {
-			asfs_brelse(bh);
+		if (error) {
 			unlock_super(sb);
 			return error;
 		}
-		ASFS_I(inode)->mmu_private += addedblocks * sb->s_blocksize;
-		inode->i_blocks += addedblocks;
-		ASFS_I(inode)->ext_cache.key = 0;
-		ASFS_I(inode)->firstblock = be32_to_cpu(obj->object.file.data);
-		asfs_brelse(bh);
 	}
 #endif
 
-	if (ASFS_I(inode)->ext_cache.key > 0 && ASFS_I(inode)->ext_cache.startblock <= block) {
-		extent.key = ASFS_I(inode)->ext_cache.key;
-		extent.next = ASFS_I(inode)->ext_cache.next;
-		extent.blocks = ASFS_I(inode)->ext_cache.blocks;
-		pos = ASFS_I(inode)->ext_cache.startblock;
-	} else {
-		if (asfs_getextent(inode->i_sb, ASFS_I(inode)->firstblock, &ebn_bh, &ebn_p) != 0) {
-			unlock_super(sb);
-			return -EIO;
-		}
-		extent.key = be32_to_cpu(ebn_p->key);
-		extent.next = be32_to_cpu(ebn_p->next);
-		extent.blocks = be16_to_cpu(ebn_p->blocks);
-		pos = 0;
-		asfs_brelse(ebn_bh);
+	if ((error = asfs_extmap_find(inode, block, &ext)) != 0) {
+		unlock_super(sb);
+		return error;
 	}
-	ebn_p = &extent;
-	filedata = ebn_p->next;
 
-	while (pos + ebn_p->blocks <= block && ebn_p->next != 0 && pos < inode->i_blocks) {
-		pos += ebn_p->blocks;
-		if (asfs_getextent(inode->i_sb, filedata, &ebn_bh, &ebn_p) != 0) {
-			unlock_super(sb);
-			return -EIO;
-		}
-		extent.key = be32_to_cpu(ebn_p->key);
-		extent.next = be32_to_cpu(ebn_p->next);
-		extent.blocks = be16_to_cpu(ebn_p->blocks);
-		ebn_p = &extent;	
-		filedata = ebn_p->next;
-		asfs_brelse(ebn_bh);
+	*pblock = ext->key + block - ext->startblock;
+	*new = create;
+
+	blocks = ext->startblock + ext->blocks - block;
+	if (blocks > inode->i_blocks - block)
+		blocks = inode->i_blocks - block;
+	if (blocks > maxblocks)
+		blocks = maxblocks;
+	if (blocks == 0)
+		blocks = 1;
+
+#ifdef CONFIG_ASFS_RW
+	/* mmu_private is the end of the blocks handed out for writing, blocks
+	   allocated but not written yet (chunk tails, fallocate) lie past it
+	   and are zeroed by cont_write_begin() before they are used. */
+	if (extend) {
+		spin_lock(&ASFS_SB(sb)->reserve_lock);
+		if (((loff_t) (block + blocks) << sb->s_blocksize_bits) > ASFS_I(inode)->mmu_private)
+			ASFS_I(inode)->mmu_private = (loff_t) (block + blocks) << sb->s_blocksize_bits;
+		spin_unlock(&ASFS_SB(sb)->reserve_lock);
 	}
+#endif
 
 	unlock_super(sb);
 
-	map_bh(bh_result, inode->i_sb, (sector_t) (ebn_p->key + block - pos));
+	return blocks;
+}
 
-	if (create)
-		set_buffer_new(bh_result);
+/* get_block_t adapter for the generic buffer_head based helpers.  The
+   mapped run is reported back through bh_result->b_size, so mpage and
+   direct I/O can build large bios. */
 
-	asfs_debug("ASFS: get_block - mapped block %lu\n", ebn_p->key + block - pos);
+static int
+asfs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh_result, int create)
+{
+	u32 pblock;
+	int blocks, new;
 
-	ASFS_I(inode)->ext_cache.startblock = pos;
-	ASFS_I(inode)->ext_cache.key = ebn_p->key;
-	ASFS_I(inode)->ext_cache.next = ebn_p->next;
-	ASFS_I(inode)->ext_cache.blocks = ebn_p->blocks;
+	asfs_debug("ASFS: get_block(%lu, %ld, %d)\n", inode->i_ino, block, create);
+
+	if (block < 0) {
+		printk(KERN_ERR "ASFS: asfsget_block: requested block (%ld) < 0!\n", block);
+		return -EIO;
+	} else if (block >= inode->i_blocks && !create)
+		return 0;	/* past the end of file, leave bh_result unmapped */
+
+	blocks = asfs_map_blocks(inode, block, bh_result->b_size >> inode->i_sb->s_blocksize_bits, create, &pblock, &new);
+	if (blocks < 0)
+		return blocks;
+
+	map_bh(bh_result, inode->i_sb, (sector_t) pblock);
+	bh_result->b_size = blocks << inode->i_sb->s_blocksize_bits;
+
+	if (new)
+		set_buffer_new(bh_result);
+
+	asfs_debug("ASFS: get_block - mapped block %u (%d blocks)\n", pblock, blocks);
 
 	return 0;
 }
@@ -143,15 +395,98 @@ asfs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh_resul
 int asfs_readpage(struct file *file, struct page *page)
 {
 	asfs_debug("ASFS: %s\n", __FUNCTION__);
-	return block_read_full_page(page, asfs_get_block);
+	return mpage_readpage(page, asfs_get_block);
+}
+
+int asfs_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages)
+{
+	asfs_debug("ASFS: %s (%u pages)\n", __FUNCTION__, nr_pages);
+	return mpage_readpages(mapping, pages, nr_pages, asfs_get_block);
 }
 
 sector_t asfs_bmap(struct address_space *mapping, sector_t block)
 {
 	asfs_debug("ASFS: %s\n", __FUNCTION__);
+	if (ASFS_I(mapping->host)->reserved)
+		filemap_write_and_wait(mapping);
 	return generic_block_bmap(mapping,block,asfs_get_block);
 }
 
+/* Direct I/O maps user buffers straight onto the extents, extending
+   writes get whole extents allocated by asfs_get_block().  SFS files
+   cannot have holes, so a write starting past the end of file is left to
+   the buffered path, which zeroes the gap. */
+
+ssize_t asfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov, loff_t offset, unsigned long nr_segs)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+
+	asfs_debug("ASFS: %s (%s at %lld)\n", __FUNCTION__, rw == WRITE ? "write" : "read", offset);
+
+	if (rw == WRITE && offset > i_size_read(inode))
+		return 0;
+
+	return blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov, offset, nr_segs, asfs_get_block, NULL);
+}
+
+/* Reports the layout of a file by walking its fsExtentBNode chain through
+   the extent map.  The map is looked at under lock_super() one extent at
+   a time, because filling the user's buffer may fault. */
+
+int asfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct inramExtent *ext, extent;
+	u32 block, endblock, fileblocks;
+	int error;
+
+	asfs_debug("ASFS: %s (node %lu, start %llu, len %llu)\n", __FUNCTION__, inode->i_ino, start, len);
+
+	if ((error = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC)) != 0)
+		return error;
+
+	/* delayed blocks have no extents yet */
+	if (ASFS_I(inode)->reserved)
+		filemap_write_and_wait(inode->i_mapping);
+
+	fileblocks = (i_size_read(inode) + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+
+	if (len == 0 || start >= ((u64) fileblocks << sb->s_blocksize_bits))
+		return 0;
+
+	block = start >> sb->s_blocksize_bits;
+	if (len > ((u64) fileblocks << sb->s_blocksize_bits) - start)
+		endblock = fileblocks;
+	else
+		endblock = (start + len + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+
+	while (block < endblock) {
+		u32 extentend;
+
+		lock_super(sb);
+		if ((error = asfs_extmap_find(inode, block, &ext)) == 0)
+			extent = *ext;
+		unlock_super(sb);
+		if (error)
+			return error;
+
+		extentend = extent.startblock + extent.blocks;
+		if (extentend > fileblocks)
+			extentend = fileblocks;
+
+		error = fiemap_fill_next_extent(fieinfo, (u64) extent.startblock << sb->s_blocksize_bits,
+					(u64) extent.key << sb->s_blocksize_bits,
+					(u64) (extentend - extent.startblock) << sb->s_blocksize_bits,
+					extentend == fileblocks ? FIEMAP_EXTENT_LAST : 0);
+		if (error)
+			return error < 0 ? error : 0;
+
+		block = extentend;
+	}
+
+	return 0;
+}
+
 #ifdef CONFIG_ASFS_RW
 
 int asfs_writepage(struct page *page, struct writeback_control *wbc)
@@ -160,15 +495,255 @@ int asfs_writepage(struct page *page, struct writeback_control *wbc)
 	return block_write_full_page(page, asfs_get_block, wbc);
 }
 
+/* Maps the delayed buffers of dirty pages between file blocks /start/ and
+   /end/, which have just been allocated. */
+
+static int asfs_map_delayed(struct inode *inode, u32 start, u32 end)
+{
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int bits = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	pgoff_t index = start >> bits;
+	pgoff_t last = (end - 1) >> bits;
+	struct pagevec pvec;
+	int error = 0;
+
+	pagevec_init(&pvec, 0);
+
+	while (error == 0 && index <= last) {
+		unsigned int i, nr;
+
+		nr = pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY,
+					min(last - index, (pgoff_t) PAGEVEC_SIZE - 1) + 1);
+		if (nr == 0)
+			break;
+
+		for (i = 0; i < nr && error == 0; i++) {
+			struct page *page = pvec.pages[i];
+			struct buffer_head *head, *bh;
+			sector_t block;
+
+			if (page->index > last)
+				break;
+
+			lock_page(page);
+			if (page->mapping == mapping && page_has_buffers(page)) {
+				block = (sector_t) page->index << bits;
+				bh = head = page_buffers(page);
+				do {
+					u32 pblock;
+					int new;
+
+					if (buffer_delay(bh) && block < end) {
+						if ((error = asfs_map_blocks(inode, block, 1, 0, &pblock, &new)) < 0)
+							break;
+						error = 0;
+						map_bh(bh, inode->i_sb, (sector_t) pblock);
+						clear_buffer_delay(bh);
+					}
+					block++;
+				} while ((bh = bh->b_this_page) != head);
+			}
+			unlock_page(page);
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+
+	return error;
+}
+
+/* Allocates the whole delayed range of the file at once and maps its
+   buffers, then lets mpage build bios as large as the extents.  Pages
+   which still have delayed buffers go through asfs_writepage(). */
+
+int asfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	u32 start = inode->i_blocks;
+	u32 reserved = ASFS_I(inode)->reserved;
+	int error;
+
+	asfs_debug("ASFS: %s (node %lu, %u reserved)\n", __FUNCTION__, inode->i_ino, reserved);
+
+	if (reserved) {
+		u32 pblock;
+		int new;
+
+		if ((error = asfs_map_blocks(inode, start, reserved, 1, &pblock, &new)) < 0 ||
+		    (error = asfs_map_delayed(inode, start, inode->i_blocks)) < 0)
+			return error;
+	}
+
+	return mpage_writepages(mapping, wbc, asfs_get_block);
+}
+
+/* get_block_t used by write_begin.  Blocks past the allocated end of the
+   file are only reserved and mapped as delayed, asfs_get_block() picks
+   the extents at writeback time for the whole reserved range, so files
+   written in small appends end up in a few large extents.  Reserving
+   only takes reserve_lock, writers don't wait for lock_super() while
+   other files are being allocated. */
+
+static int
+asfs_get_block_prep(struct inode *inode, sector_t block, struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct asfs_inode_info *ai = ASFS_I(inode);
+	spinlock_t *lock = &ASFS_SB(sb)->reserve_lock;
+	int retried = FALSE;
+	int error = 0;
+
+	/* an unlinked file has no object left, its delayed blocks could never
+	   be allocated */
+	if (inode->i_nlink == 0)
+		return -EIO;
+
+retry:
+	spin_lock(lock);
+
+	if (block < inode->i_blocks) {
+		spin_unlock(lock);
+		return asfs_get_block(inode, block, bh_result, create);
+	}
+
+	if (block >= inode->i_blocks + ai->reserved) {
+		u32 blocks = block + 1 - inode->i_blocks - ai->reserved;
+		u32 meta = asfs_metaestimate(sb, ai->reserved + blocks);
+
+		if ((error = asfs_reservespace(sb, blocks + meta - ai->metareserved)) != 0) {
+			spin_unlock(lock);
+			/* blocks of deleted files may still be on their way back */
+			if (error == -ENOSPC && !retried && asfs_waitfrees(sb)) {
+				retried = TRUE;
+				goto retry;
+			}
+			return error;
+		}
+		ai->reserved += blocks;
+		ai->metareserved = meta;
+	}
+
+	ai->modified = TRUE;
+	if (((loff_t) (block + 1) << sb->s_blocksize_bits) > ai->mmu_private)
+		ai->mmu_private = (loff_t) (block + 1) << sb->s_blocksize_bits;
+
+	spin_unlock(lock);
+
+	asfs_debug("ASFS: get_block_prep - delayed block %ld (node %lu, %u reserved)\n", block, inode->i_ino, ai->reserved);
+
+	/* Delayed buffers are left unmapped, so that mpage hands pages it
+	   finds them on to asfs_writepage().  Only a buffer seen for the
+	   first time is new, its data must not be zeroed on later writes. */
+	bh_result->b_bdev = sb->s_bdev;
+	bh_result->b_blocknr = ~0;
+	if (!buffer_delay(bh_result))
+		set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+
+	return 0;
+}
+
 int asfs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata)
 {
 	asfs_debug("ASFS: %s\n", __FUNCTION__);
 	*pagep = NULL;
-	return cont_write_begin(file, mapping, pos, len, flags, pagep, fsdata, asfs_get_block, &ASFS_I(mapping->host)->mmu_private);
+	return cont_write_begin(file, mapping, pos, len, flags, pagep, fsdata, asfs_get_block_prep, &ASFS_I(mapping->host)->mmu_private);
 }
 
 
 
+/* Preallocates the blocks needed to hold /offset/ + /len/ bytes.  SFS has
+   neither holes nor unwritten extents, so blocks are always added at the
+   end of the extent chain, asking asfs_findspace() for the biggest
+   contiguous runs up front.  Without FALLOC_FL_KEEP_SIZE the file is then
+   extended through the page cache, which zeroes the new range.  Blocks
+   past the end of file are given back on the last close, as the on-disk
+   format has no way to record them. */
+
+long asfs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	loff_t newsize = offset + len;
+	u32 blocks;
+	int error = 0;
+
+	asfs_debug("ASFS: fallocate (node %lu, mode %d, offset %lld, len %lld)\n", inode->i_ino, mode, offset, len);
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	if (newsize > sb->s_maxbytes)
+		return -EFBIG;
+
+	blocks = (newsize + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+
+	mutex_lock(&inode->i_mutex);
+
+	if (blocks > inode->i_blocks) {
+		lock_super(sb);
+		error = asfs_extendfile(inode, blocks, FALSE);
+		unlock_super(sb);
+		if (error == -ENOSPC && asfs_waitfrees(sb)) {
+			lock_super(sb);
+			error = asfs_extendfile(inode, blocks, FALSE);
+			unlock_super(sb);
+		}
+	}
+
+	if (error == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && newsize > i_size_read(inode))
+		error = generic_cont_expand_simple(inode, newsize);
+
+	mutex_unlock(&inode->i_mutex);
+
+	return error;
+}
+
+/* Gives back the blocks allocated past the end of file.  Usually they are
+   the unused tail of the preallocation window and lie in the last extent,
+   which is then shortened in place without walking the extent chain.
+   Anything else is left to asfs_truncateblocksinfile(). */
+
+static int asfs_trim_prealloc(struct inode *inode, struct buffer_head *bh, struct fsObject *obj)
+{
+	struct super_block *sb = inode->i_sb;
+	struct asfs_inode_info *ai = ASFS_I(inode);
+	u32 newblocks = (inode->i_size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	struct inramExtent *last = ai->ext_count ? &ai->ext_map[ai->ext_count - 1] : NULL;
+	struct buffer_head *ebh;
+	struct fsExtentBNode *ebn;
+	u16 blocks;
+	int error;
+
+	/* nothing past the end, or even short of it after a failed writeback */
+	if (inode->i_blocks <= newblocks)
+		return 0;
+
+	if (!last || last->next != 0 || last->startblock >= newblocks ||
+	    last->startblock + last->blocks != inode->i_blocks) {
+		ai->lastextent = 0;
+		if ((error = asfs_truncateblocksinfile(sb, bh, obj, inode->i_size, inode->i_blocks)) == 0)
+			asfs_extmap_truncate(inode, newblocks);
+		else
+			ai->ext_count = 0;
+		return error;
+	}
+
+	asfs_debug("ASFS: trim_prealloc (node %lu, %lu -> %u blocks)\n", inode->i_ino, inode->i_blocks, newblocks);
+
+	if ((error = asfs_getextent(sb, last->key, &ebh, &ebn)) != 0)
+		return error;
+
+	blocks = newblocks - last->startblock;
+	if ((error = asfs_freespace(sb, last->key + blocks, last->blocks - blocks)) == 0) {
+		ebn->blocks = cpu_to_be16(blocks);
+		asfs_bstore(sb, ebh);
+		last->blocks = blocks;
+	}
+	asfs_brelse(ebh);
+
+	return error;
+}
+
 void asfs_truncate(struct inode *inode)
 {
 	struct super_block *sb = inode->i_sb;
@@ -183,23 +758,41 @@ void asfs_truncate(struct inode *inode)
 		return;
 	}
 
+	/* Allocate delayed blocks still below the new size, whatever stays
+	   reserved belonged to pages which have just been truncated. */
+	if (ASFS_I(inode)->reserved)
+		filemap_write_and_wait(inode->i_mapping);
+
 	lock_super(sb);
 
+	spin_lock(&ASFS_SB(sb)->reserve_lock);
+	asfs_unreservespace(sb, ASFS_I(inode)->reserved + ASFS_I(inode)->metareserved);
+	ASFS_I(inode)->reserved = 0;
+	ASFS_I(inode)->metareserved = 0;
+	spin_unlock(&ASFS_SB(sb)->reserve_lock);
+	ASFS_I(inode)->prealloc = ASFS_BLOCKCHUNKS;
+
 	if ((asfs_readobject(sb, inode->i_ino, &bh, &obj)) != 0) {
 		unlock_super(sb);
 		return;
 	}
 
-	if (asfs_truncateblocksinfile(sb, bh, obj, inode->i_size) != 0) {
+	ASFS_I(inode)->lastextent = 0;
+	if (asfs_truncateblocksinfile(sb, bh, obj, inode->i_size, inode->i_blocks) != 0) {
+		ASFS_I(inode)->ext_count = 0;
 		asfs_brelse(bh);
 		unlock_super(sb);
 		return;
 	}
+	asfs_extmap_truncate(inode, (inode->i_size + sb->s_blocksize - 1) >> sb->s_blocksize_bits);
+	ASFS_I(inode)->firstblock = be32_to_cpu(obj->object.file.data);
 		
 	obj->object.file.size = cpu_to_be32(inode->i_size);
 	ASFS_I(inode)->mmu_private = inode->i_size;
 	ASFS_I(inode)->modified = TRUE;
+	spin_lock(&ASFS_SB(sb)->reserve_lock);
 	inode->i_blocks = (be32_to_cpu(obj->object.file.size) + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	spin_unlock(&ASFS_SB(sb)->reserve_lock);
 	asfs_bstore(sb, bh);
 	asfs_brelse(bh);
 
@@ -222,6 +815,11 @@ int asfs_file_release(struct inode *inode, struct file *filp)
 		if (ASFS_I(inode)->modified == TRUE) {
 			struct buffer_head *bh;
 			struct fsObject *obj;
+
+			/* the object's size may only cover allocated blocks */
+			if (ASFS_I(inode)->reserved)
+				filemap_fdatawrite(inode->i_mapping);
+
 			lock_super(inode->i_sb);
 
 			if ((error = asfs_readobject(inode->i_sb, inode->i_ino, &bh, &obj)) != 0) {
@@ -231,10 +829,19 @@ int asfs_file_release(struct inode *inode, struct file *filp)
 
 			obj->datemodified = cpu_to_be32(inode->i_mtime.tv_sec - (365*8+2)*24*60*60);
 			if (inode->i_mode & S_IFREG) {
-				error = asfs_truncateblocksinfile(inode->i_sb, bh, obj, (u32)inode->i_size);
-				obj->object.file.size = cpu_to_be32(inode->i_size);
-				ASFS_I(inode)->mmu_private = inode->i_size;
-				inode->i_blocks = (be32_to_cpu(obj->object.file.size) + inode->i_sb->s_blocksize - 1) >> inode->i_sb->s_blocksize_bits;
+				/* blocks whose writeback failed were never allocated,
+				   the size on disk must not claim them */
+				loff_t size = min_t(loff_t, inode->i_size, (loff_t) inode->i_blocks << inode->i_sb->s_blocksize_bits);
+
+				if (size < inode->i_size)
+					printk(KERN_WARNING "ASFS: node %lu: no space was allocated past %lld bytes, size cut down\n", inode->i_ino, size);
+				error = asfs_trim_prealloc(inode, bh, obj);
+				ASFS_I(inode)->firstblock = be32_to_cpu(obj->object.file.data);
+				obj->object.file.size = cpu_to_be32(size);
+				ASFS_I(inode)->mmu_private = size;
+				spin_lock(&ASFS_SB(inode->i_sb)->reserve_lock);
+				inode->i_blocks = (size + inode->i_sb->s_blocksize - 1) >> inode->i_sb->s_blocksize_bits;
+				spin_unlock(&ASFS_SB(inode->i_sb)->reserve_lock);
 			}
 			asfs_bstore(inode->i_sb, bh);
 
@@ -41,10 +41,13 @@ static int asfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 
 static struct address_space_operations asfs_aops = {
 	.readpage	= asfs_readpage,
+	.readpages	= asfs_readpages,
 	.sync_page	= block_sync_page,
 	.bmap		= asfs_bmap,
+	.direct_IO	= asfs_direct_IO,
 #ifdef CONFIG_ASFS_RW
 	.writepage	= asfs_writepage,
+	.writepages	= asfs_writepages,
 	.write_begin = asfs_write_begin,
 	.write_end = generic_write_end,
 #endif
@@ -60,6 +63,7 @@ static struct file_operations asfs_file_operations = {
 	.open		= asfs_file_open,
 	.release	= asfs_file_release,
 	.fsync		= generic_file_fsync,
+	.unlocked_ioctl	= asfs_ioctl,
 #endif
 };
 
@@ -67,6 +71,9 @@ static struct file_operations asfs_dir_operations = {
 	.read		= generic_read_dir,
 	.readdir	= asfs_readdir,
 	.llseek		= generic_file_llseek,
+#ifdef CONFIG_ASFS_RW
+	.unlocked_ioctl	= asfs_ioctl,
+#endif
 };
 
 static struct inode_operations asfs_dir_inode_operations = {
@@ -83,8 +90,10 @@ static struct inode_operations asfs_dir_inode_operations = {
 };
 
 static struct inode_operations asfs_file_inode_operations = {
+	.fiemap		= asfs_fiemap,
 #ifdef CONFIG_ASFS_RW
 	.truncate	= asfs_truncate,
+	.fallocate	= asfs_fallocate,
 /*	.setattr		= asfs_notify_change,*/
 #endif
 };
@@ -145,8 +154,8 @@ void asfs_read_locked_inode(struct inode *inode, void *arg)
 		inode->i_mapping->a_ops = &asfs_aops;
 		inode->i_mode |= S_IFREG;
 		ASFS_I(inode)->firstblock = be32_to_cpu(obj->object.file.data);
-		ASFS_I(inode)->ext_cache.startblock = 0;
-		ASFS_I(inode)->ext_cache.key = 0;
+		ASFS_I(inode)->ext_count = 0;
+		ASFS_I(inode)->lastextent = 0;
 		ASFS_I(inode)->mmu_private = inode->i_size;
 	}
 	return;	
@@ -222,6 +231,12 @@ static int asfs_create_object(struct inode *dir, struct dentry *dentry, int mode
 		break;
 	}
 
+	/* Blocks of deleted files may still be on their way back.  They can
+	   only be waited for before anything is changed, a failed
+	   asfs_createobject() may have left the object half created. */
+	if (ASFS_SB(sb)->freeblocks < ASFS_ALWAYSFREE + ASFS_SB(sb)->reservedblocks + 32)
+		asfs_waitfrees(sb);
+
 	lock_super(sb);
 
 	if ((error = asfs_readobject(sb, dir->i_ino, &dir_bh, &dir_obj)) != 0) {
@@ -262,8 +277,8 @@ static int asfs_create_object(struct inode *dir, struct dentry *dentry, int mode
 		inode->i_fop = &asfs_file_operations;
 		inode->i_mapping->a_ops = &asfs_aops;
 		ASFS_I(inode)->firstblock = be32_to_cpu(obj->object.file.data);
-		ASFS_I(inode)->ext_cache.startblock = 0;
-		ASFS_I(inode)->ext_cache.key = 0;
+		ASFS_I(inode)->ext_count = 0;
+		ASFS_I(inode)->lastextent = 0;
 		ASFS_I(inode)->mmu_private = inode->i_size;
 		break;
 	case it_link:
@@ -332,13 +347,22 @@ static int asfs_unlink(struct inode *dir, struct dentry *dentry)
 		unlock_super(sb);
 		return error;
 	}
-	if ((error = asfs_deleteobject(sb, bh, obj)) != 0) {
+	if ((error = asfs_deleteobject(sb, bh, obj, inode->i_blocks)) != 0) {
 		asfs_brelse(bh);
 		unlock_super(sb);
 		return error;
 	}
 	asfs_brelse(bh);
 
+	/* The extents of the file are freed now or soon and may be handed to
+	   another file, an open descriptor mustn't map any of them anymore. */
+	ASFS_I(inode)->ext_count = 0;
+	ASFS_I(inode)->lastextent = 0;
+	ASFS_I(inode)->firstblock = 0;
+	spin_lock(&ASFS_SB(sb)->reserve_lock);
+	inode->i_blocks = 0;
+	spin_unlock(&ASFS_SB(sb)->reserve_lock);
+
 	/* directory data could change after removing the object */
 	if ((error = asfs_readobject(sb, dir->i_ino, &dir_bh, &dir_obj)) != 0) {
 		unlock_super(sb);
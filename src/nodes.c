@@ -147,7 +147,7 @@ static int addnewnodelevel(struct super_block *sb, u16 nodesize)
 		struct buffer_head *newbh;
 		u32 newblock;
 
-		if ((errorcode = asfs_allocadminspace(sb, &newblock)) == 0 && (newbh = asfs_getzeroblk(sb, newblock))) {
+		if ((errorcode = asfs_allocadminspace(sb, noderoot, &newblock)) == 0 && (newbh = asfs_getzeroblk(sb, newblock))) {
 			struct fsNodeContainer *nc = (void *) bh->b_data;
 			struct fsNodeContainer *newnc = (void *) newbh->b_data;
 
@@ -181,7 +181,7 @@ static int addnewnodelevel(struct super_block *sb, u16 nodesize)
 	return errorcode;
 }
 
-static int createnodecontainer(struct super_block *sb, u32 nodenumber, u32 nodes, u32 * returned_block)
+static int createnodecontainer(struct super_block *sb, u32 goal, u32 nodenumber, u32 nodes, u32 * returned_block)
 {
 	struct buffer_head *bh;
 	int errorcode;
@@ -189,7 +189,7 @@ static int createnodecontainer(struct super_block *sb, u32 nodenumber, u32 nodes
 
 	asfs_debug("createnodecontainer: nodenumber = %u, nodes = %u\n", nodenumber, nodes);
 
-	if ((errorcode = asfs_allocadminspace(sb, &newblock)) == 0 && (bh = asfs_getzeroblk(sb, newblock))) {
+	if ((errorcode = asfs_allocadminspace(sb, goal, &newblock)) == 0 && (bh = asfs_getzeroblk(sb, newblock))) {
 		struct fsNodeContainer *nc = (void *) bh->b_data;
 
 		nc->bheader.id = cpu_to_be32(ASFS_NODECONTAINER_ID);
@@ -326,7 +326,7 @@ int asfs_createnode(struct super_block *sb, struct buffer_head **returned_bh, st
 						nodes = be32_to_cpu(nc->nodes) / NODECONT_BLOCK_COUNT;
 					}
 
-					if ((errorcode = createnodecontainer(sb, be32_to_cpu(nc->nodenumber) + (p - nc->node) * be32_to_cpu(nc->nodes), nodes, &newblock)) != 0) {
+					if ((errorcode = createnodecontainer(sb, nodeindex, be32_to_cpu(nc->nodenumber) + (p - nc->node) * be32_to_cpu(nc->nodes), nodes, &newblock)) != 0) {
 						break;
 					}
 
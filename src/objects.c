@@ -145,18 +145,10 @@ static int removeobjectcontainer(struct super_block *sb, struct buffer_head *bh)
 
 static int setrecycledinfodiff(struct super_block *sb, s32 deletedfiles, s32 deletedblocks)
 {
-	struct buffer_head *bh;
-
-	if ((bh = asfs_breadcheck(sb, ASFS_SB(sb)->rootobjectcontainer, ASFS_OBJECTCONTAINER_ID))) {
-		struct fsRootInfo *ri = (struct fsRootInfo *) ((u8 *) bh->b_data + sb->s_blocksize - sizeof(struct fsRootInfo));
-
-		ri->deletedfiles = cpu_to_be32(be32_to_cpu(ri->deletedfiles) + deletedfiles);
-		ri->deletedblocks = cpu_to_be32(be32_to_cpu(ri->deletedblocks) + deletedblocks);
-
-		asfs_bstore(sb, bh);
-		asfs_brelse(bh);
-	} else
-		return -EIO;
+	/* written back with the other fsRootInfo counters, see asfs_writerootinfo() */
+	ASFS_SB(sb)->deletedfiles += deletedfiles;
+	ASFS_SB(sb)->deletedblocks += deletedblocks;
+	sb->s_dirt = 1;
 	return 0;
 }
 
@@ -295,8 +287,10 @@ static int removeobject(struct super_block *sb, struct buffer_head *bh, struct f
 	return (errorcode);
 }
 
-	/* This function deletes the specified object. */
-int asfs_deleteobject(struct super_block *sb, struct buffer_head *bh, struct fsObject *o)
+	/* This function deletes the specified object.  /blocks/ is the number
+	   of blocks allocated to a file, its extents are freed in the
+	   background. */
+int asfs_deleteobject(struct super_block *sb, struct buffer_head *bh, struct fsObject *o, u32 blocks)
 {
 	int errorcode = 0;
 
@@ -316,8 +310,7 @@ int asfs_deleteobject(struct super_block *sb, struct buffer_head *bh, struct fsO
 				errorcode = asfs_freeadminspace(sb, hashblckno);
 			} else {
 				asfs_debug("deleteobject: Object is a file\n");
-				if (extentbnode != 0)
-					errorcode = asfs_deleteextents(sb, extentbnode);
+				errorcode = asfs_deferfree(sb, extentbnode, blocks);
 			}
 		}
 	}
@@ -417,7 +410,8 @@ static int findobjectspace(struct super_block *sb, struct buffer_head **io_bh, s
 		   space large enough for our entry.  We allocate new space and add it to this
 		   directory. */
 
-		if ((errorcode = asfs_allocadminspace(sb, &newcontblock)) == 0 && (bh = asfs_getzeroblk(sb, newcontblock))) {
+		/* near the other containers of the directory */
+		if ((errorcode = asfs_allocadminspace(sb, oparent->object.dir.firstdirblock ? be32_to_cpu(oparent->object.dir.firstdirblock) : bhparent->b_blocknr, &newcontblock)) == 0 && (bh = asfs_getzeroblk(sb, newcontblock))) {
 			struct fsObjectContainer *oc = (void *) bh->b_data;
 			struct buffer_head *bhnext;
 
@@ -515,7 +509,7 @@ int asfs_createobject(struct super_block *sb, struct buffer_head **io_bh, struct
 
 				asfs_debug("creating Hashblock\n");
 
-				if ((errorcode = asfs_allocadminspace(sb, &hashblock)) == 0 && (hashbh = asfs_getzeroblk(sb, hashblock))) {	    
+				if ((errorcode = asfs_allocadminspace(sb, (*io_bh)->b_blocknr, &hashblock)) == 0 && (hashbh = asfs_getzeroblk(sb, hashblock))) {	    
 					struct fsHashTable *ht = (void *) hashbh->b_data;
 
 					o2->object.dir.hashtable = cpu_to_be32(hashblock);
@@ -535,7 +529,7 @@ int asfs_createobject(struct super_block *sb, struct buffer_head **io_bh, struct
 				struct buffer_head *bh2;
 				u32 slinkblock;
 
-				if ((errorcode = asfs_allocadminspace(sb, &slinkblock)) == 0 && (bh2 = asfs_getzeroblk(sb, slinkblock))) {
+				if ((errorcode = asfs_allocadminspace(sb, (*io_bh)->b_blocknr, &slinkblock)) == 0 && (bh2 = asfs_getzeroblk(sb, slinkblock))) {
 					struct fsSoftLink *sl = (void *) bh2->b_data;
 					o2->object.file.data = cpu_to_be32(slinkblock);
 					sl->bheader.id = cpu_to_be32(ASFS_SOFTLINK_ID);
@@ -562,7 +556,12 @@ int asfs_createobject(struct super_block *sb, struct buffer_head **io_bh, struct
 		ExtentBNode. It returns the number of added blocks through 
 		addedblocks pointer */
 
-int asfs_addblockstofile(struct super_block *sb, struct buffer_head *objbh, struct fsObject *o, u32 blocks, u32 * newspace, u32 * addedblocks)
+	/* /io_lastextentbnode/ is the key of the last ExtentBNode of the file if
+	   the caller knows it, or 0.  The chain is only walked from there, so
+	   appending to a file with many extents doesn't walk all of them.  It
+	   is updated to the new last ExtentBNode on return. */
+
+int asfs_addblockstofile(struct super_block *sb, struct buffer_head *objbh, struct fsObject *o, u32 blocks, u32 * io_lastextentbnode, u32 * newspace, u32 * addedblocks)
 {
 	u32 lastextentbnode;
 	int errorcode = 0;
@@ -573,6 +572,8 @@ int asfs_addblockstofile(struct super_block *sb, struct buffer_head *objbh, stru
 	asfs_debug("extendblocksinfile: Trying to increasing number of blocks by %d.\n", blocks);
 
 	lastextentbnode = be32_to_cpu(o->object.file.data);
+	if (lastextentbnode != 0 && *io_lastextentbnode != 0)
+		lastextentbnode = *io_lastextentbnode;
 
 	if (lastextentbnode != 0) {
 		while (lastextentbnode != 0 && errorcode == 0) {
@@ -593,10 +594,18 @@ int asfs_addblockstofile(struct super_block *sb, struct buffer_head *objbh, stru
 		*addedblocks = 0;
 		*newspace = 0;
 
+		/* continue right after the last extent.  New files are placed near
+		   the object container of their directory, so that small files of
+		   one directory stay together, unless there is no room for them
+		   there, then they start at the roving pointer. */
 		if (lastextentbnode != 0)
 			searchstart = be32_to_cpu(ebnp->key) + be16_to_cpu(ebnp->blocks);
+		else if (asfs_spacenear(sb, objbh->b_blocknr, blocks))
+			searchstart = objbh->b_blocknr;
 		else
-			searchstart = 0; //ASFS_SB(sb)->block_rovingblockptr;
+			searchstart = ASFS_SB(sb)->block_rovingblockptr;
+		if (searchstart >= ASFS_SB(sb)->totalblocks)
+			searchstart = 0;
 
 		if ((errorcode = asfs_findspace(sb, blocks, searchstart, searchstart, &found_block, &found_blocks)) != 0) {
 			asfs_brelse(block);
@@ -618,6 +627,7 @@ int asfs_addblockstofile(struct super_block *sb, struct buffer_head *objbh, stru
 
 		if (o->object.file.data == 0)
 			o->object.file.data = cpu_to_be32(lastextentbnode);
+		*io_lastextentbnode = lastextentbnode;
 	}
 
 	if (block)
@@ -686,9 +696,10 @@ int asfs_renameobject(struct super_block *sb, struct buffer_head *bh1, struct fs
 	return errorcode;
 }
 
-		/* Truncates the specified file to /newsize/ bytes */
+		/* Truncates the specified file to /newsize/ bytes, /blocks/ is the
+		   number of blocks allocated to it */
 
-int asfs_truncateblocksinfile(struct super_block *sb, struct buffer_head *bh, struct fsObject *o, u32 newsize)
+int asfs_truncateblocksinfile(struct super_block *sb, struct buffer_head *bh, struct fsObject *o, u32 newsize, u32 blocks)
 {
 	struct buffer_head *ebh;
 	struct fsExtentBNode *ebn;
@@ -728,7 +739,9 @@ int asfs_truncateblocksinfile(struct super_block *sb, struct buffer_head *bh, st
 		asfs_brelse(ebh);
 		return errorcode;
 	}
-	if (be32_to_cpu(ebn->next) > 0 && (errorcode = asfs_deleteextents(sb, be32_to_cpu(ebn->next))) != 0) {
+	/* the rest of the chain goes in the background */
+	pos += be16_to_cpu(ebn->blocks);
+	if (be32_to_cpu(ebn->next) > 0 && (errorcode = asfs_deferfree(sb, be32_to_cpu(ebn->next), blocks > pos ? blocks - pos : 0)) != 0) {
 		asfs_brelse(ebh);
 		return errorcode;
 	}
@@ -0,0 +1,345 @@
+/*
+ *
+ * Amiga Smart File System, Linux implementation
+ * version: 1.0beta13
+ *
+ * In-memory index of free disk space.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/rbtree.h>
+#include "asfs_fs.h"
+#include "bitfuncs.h"
+
+#include <asm/byteorder.h>
+
+#ifdef CONFIG_ASFS_RW
+
+/* Every run of free blocks is kept in two rbtrees, one sorted by start
+   block and one by length, so that looking for space near a given block
+   or for the best fitting run doesn't read the bitmap.  The index is built
+   from the bitmap the first time space is searched for and is kept in sync
+   by asfs_markspace() and asfs_freespace().  If it ever runs out of memory
+   or finds itself out of sync with the bitmap, it is dropped and searches
+   go back to the bitmap until the next remount, instead of reading the
+   whole bitmap again on every allocation.  Everything here is called
+   under lock_super(). */
+
+struct asfs_freerun {
+	struct rb_node bystart;
+	struct rb_node bylen;
+	u32 start;
+	u32 blocks;
+};
+
+/* number of runs following the goal which are tried before the best fit */
+#define ASFS_SPACEINDEX_NEAR 8
+
+static void insertbylen(struct asfs_sb_info *sbi, struct asfs_freerun *run)
+{
+	struct rb_node **p = &sbi->space_bylen.rb_node, *parent = NULL;
+
+	while (*p) {
+		struct asfs_freerun *r = rb_entry(*p, struct asfs_freerun, bylen);
+
+		parent = *p;
+		if (run->blocks < r->blocks || (run->blocks == r->blocks && run->start < r->start))
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&run->bylen, parent, p);
+	rb_insert_color(&run->bylen, &sbi->space_bylen);
+}
+
+static void insertbystart(struct asfs_sb_info *sbi, struct asfs_freerun *run)
+{
+	struct rb_node **p = &sbi->space_bystart.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (run->start < rb_entry(*p, struct asfs_freerun, bystart)->start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&run->bystart, parent, p);
+	rb_insert_color(&run->bystart, &sbi->space_bystart);
+}
+
+static int addrun(struct asfs_sb_info *sbi, u32 start, u32 blocks)
+{
+	struct asfs_freerun *run;
+
+	if (!(run = kmalloc(sizeof(struct asfs_freerun), GFP_NOFS)))
+		return -ENOMEM;
+
+	run->start = start;
+	run->blocks = blocks;
+	insertbystart(sbi, run);
+	insertbylen(sbi, run);
+
+	return 0;
+}
+
+static void resizerun(struct asfs_sb_info *sbi, struct asfs_freerun *run, u32 start, u32 blocks)
+{
+	rb_erase(&run->bylen, &sbi->space_bylen);
+	run->start = start;
+	run->blocks = blocks;
+	insertbylen(sbi, run);
+}
+
+static void deleterun(struct asfs_sb_info *sbi, struct asfs_freerun *run)
+{
+	rb_erase(&run->bystart, &sbi->space_bystart);
+	rb_erase(&run->bylen, &sbi->space_bylen);
+	kfree(run);
+}
+
+/* Returns the last run starting at or before /block/, or NULL. */
+
+static struct asfs_freerun *findrun(struct asfs_sb_info *sbi, u32 block)
+{
+	struct rb_node *n = sbi->space_bystart.rb_node;
+	struct asfs_freerun *found = NULL;
+
+	while (n) {
+		struct asfs_freerun *r = rb_entry(n, struct asfs_freerun, bystart);
+
+		if (block < r->start)
+			n = n->rb_left;
+		else {
+			found = r;
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+void asfs_dropspaceindex(struct super_block *sb)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct rb_node *n;
+
+	while ((n = rb_first(&sbi->space_bystart)) != NULL)
+		deleterun(sbi, rb_entry(n, struct asfs_freerun, bystart));
+
+	sbi->space_indexed = FALSE;
+	sbi->space_noindex = TRUE;
+}
+
+/* The last bitmap block may describe blocks past the end of disk. */
+
+static int addbitmaprun(struct asfs_sb_info *sbi, u32 start, u32 blocks)
+{
+	if (start >= sbi->totalblocks || blocks == 0)
+		return 0;
+	if (start + blocks > sbi->totalblocks)
+		blocks = sbi->totalblocks - start;
+
+	return addrun(sbi, start, blocks);
+}
+
+/* Reads the whole bitmap once and fills the index with its free runs. */
+
+int asfs_buildspaceindex(struct super_block *sb)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	u32 longs = sbi->blocks_inbitmap >> 5;
+	u32 runstart = 0, runblocks = 0;
+	u32 i;
+	int error = 0;
+
+	asfs_debug("buildspaceindex: indexing %u bitmap blocks\n", sbi->blocks_bitmap);
+
+	for (i = 0; i < sbi->blocks_bitmap && error == 0; i++) {
+		struct buffer_head *bh;
+		struct fsBitmap *b;
+		u32 base = i * sbi->blocks_inbitmap;
+		int bitstart, bitend = 0;
+
+		if (i % ASFS_BITMAP_READAHEAD == 0)
+			asfs_readaheadbitmap(sb, sbi->bitmapbase + i, ASFS_BITMAP_READAHEAD);
+		if (!(bh = asfs_getbitmap(sb, sbi->bitmapbase + i))) {
+			error = -EIO;
+			break;
+		}
+		b = (void *) bh->b_data;
+		asfs_summarizebitmap(sb, sbi->bitmapbase + i, b);
+
+		while (error == 0 && bitend < sbi->blocks_inbitmap && (bitstart = bmffo(b->bitmap, longs, bitend)) >= 0) {
+			if ((bitend = bmffz(b->bitmap, longs, bitstart)) < 0)
+				bitend = sbi->blocks_inbitmap;
+			if (runstart + runblocks == base + bitstart)
+				runblocks += bitend - bitstart;
+			else {
+				error = addbitmaprun(sbi, runstart, runblocks);
+				runstart = base + bitstart;
+				runblocks = bitend - bitstart;
+			}
+		}
+		asfs_brelse(bh);
+	}
+
+	if (error == 0)
+		error = addbitmaprun(sbi, runstart, runblocks);
+
+	if (error) {
+		printk(KERN_WARNING "ASFS: Unable to index free space (error %d), searching the bitmap until remount\n", error);
+		asfs_dropspaceindex(sb);
+		return error;
+	}
+
+	sbi->space_indexed = TRUE;
+	return 0;
+}
+
+/* Same contract as asfs_findspace() over the whole disk: the first run of
+   /maxneeded/ blocks at or after /goal/ is preferred, looking only a few
+   runs ahead, then the smallest run which is big enough and, if there is
+   none, the largest one. */
+
+int asfs_searchspaceindex(struct super_block *sb, u32 maxneeded, u32 goal, u32 * returned_block, u32 * returned_blocks)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_freerun *run, *fit = NULL;
+	struct rb_node *n;
+	int near;
+
+	*returned_block = 0;
+	*returned_blocks = 0;
+
+	if (RB_EMPTY_ROOT(&sbi->space_bystart))
+		return -ENOSPC;
+
+	if ((run = findrun(sbi, goal)) != NULL && run->start + run->blocks > goal) {
+		if (run->start + run->blocks - goal >= maxneeded) {
+			*returned_block = goal;
+			*returned_blocks = maxneeded;
+			return 0;
+		}
+		n = rb_next(&run->bystart);
+	} else
+		n = run ? rb_next(&run->bystart) : rb_first(&sbi->space_bystart);
+
+	for (near = 0; near < ASFS_SPACEINDEX_NEAR; near++) {
+		if (n == NULL && (n = rb_first(&sbi->space_bystart)) == NULL)
+			break;
+		run = rb_entry(n, struct asfs_freerun, bystart);
+		if (run->blocks >= maxneeded) {
+			*returned_block = run->start;
+			*returned_blocks = maxneeded;
+			return 0;
+		}
+		n = rb_next(n);
+	}
+
+	n = sbi->space_bylen.rb_node;
+	while (n) {
+		run = rb_entry(n, struct asfs_freerun, bylen);
+		if (run->blocks >= maxneeded) {
+			fit = run;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+
+	if (fit) {
+		*returned_block = fit->start;
+		*returned_blocks = maxneeded;
+	} else {
+		run = rb_entry(rb_last(&sbi->space_bylen), struct asfs_freerun, bylen);
+		*returned_block = run->start;
+		*returned_blocks = run->blocks;
+	}
+
+	return 0;
+}
+
+/* Removes blocks just marked in the bitmap from the index. */
+
+void asfs_markspaceindex(struct super_block *sb, u32 block, u32 blocks)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_freerun *run;
+	u32 end, runend;
+
+	if (!sbi->space_indexed)
+		return;
+
+	end = block + blocks;
+	run = findrun(sbi, block);
+
+	if (run == NULL || run->start + run->blocks < end) {
+		printk(KERN_WARNING "ASFS: Free space index out of sync at block %u, dropping it\n", block);
+		asfs_dropspaceindex(sb);
+		return;
+	}
+
+	runend = run->start + run->blocks;
+
+	if (run->start == block && runend == end)
+		deleterun(sbi, run);
+	else if (run->start == block)
+		resizerun(sbi, run, end, runend - end);	/* order of runs is kept */
+	else {
+		resizerun(sbi, run, run->start, block - run->start);
+		if (runend > end && addrun(sbi, end, runend - end) != 0)
+			asfs_dropspaceindex(sb);
+	}
+}
+
+/* Adds blocks just freed in the bitmap to the index, merging them with
+   the neighbouring runs. */
+
+void asfs_freespaceindex(struct super_block *sb, u32 block, u32 blocks)
+{
+	struct asfs_sb_info *sbi = ASFS_SB(sb);
+	struct asfs_freerun *prev, *next = NULL;
+	struct rb_node *n;
+	u32 end;
+
+	if (!sbi->space_indexed)
+		return;
+
+	end = block + blocks;
+	prev = findrun(sbi, block);
+
+	if (prev)
+		n = rb_next(&prev->bystart);
+	else
+		n = rb_first(&sbi->space_bystart);
+	if (n)
+		next = rb_entry(n, struct asfs_freerun, bystart);
+
+	if ((prev && prev->start + prev->blocks > block) || (next && next->start < end)) {
+		printk(KERN_WARNING "ASFS: Free space index out of sync at block %u, dropping it\n", block);
+		asfs_dropspaceindex(sb);
+		return;
+	}
+
+	if (prev && prev->start + prev->blocks == block) {
+		if (next && next->start == end) {
+			end = next->start + next->blocks;
+			deleterun(sbi, next);
+		}
+		resizerun(sbi, prev, prev->start, end - prev->start);
+	} else if (next && next->start == end) {
+		/* the start key changes, but the order of runs doesn't */
+		resizerun(sbi, next, block, next->blocks + blocks);
+	} else if (addrun(sbi, block, blocks) != 0)
+		asfs_dropspaceindex(sb);
+}
+
+#endif
@@ -59,6 +59,7 @@
 #include <linux/vfs.h>
 #include <linux/parser.h>
 #include <linux/nls.h>
+#include <linux/vmalloc.h>
 #include "asfs_fs.h"
 
 #include <asm/byteorder.h>
@@ -68,9 +69,15 @@ static void asfs_put_super(struct super_block *sb);
 static int asfs_statfs(struct dentry *dentry, struct kstatfs *buf);
 #ifdef CONFIG_ASFS_RW
 static int asfs_remount(struct super_block *sb, int *flags, char *data);
+static void asfs_write_super(struct super_block *sb);
+static void asfs_setpinbitmap(struct super_block *sb, int readonly);
+static int asfs_sync_fs(struct super_block *sb, int wait);
 #endif
 static struct inode *asfs_alloc_inode(struct super_block *sb);
 static void asfs_destroy_inode(struct inode *inode);
+#ifdef CONFIG_ASFS_RW
+static void asfs_evict_inode(struct inode *inode);
+#endif
 
 static char asfs_default_codepage[] = CONFIG_ASFS_DEFAULT_CODEPAGE;
 static char asfs_default_iocharset[] = CONFIG_NLS_DEFAULT;
@@ -94,6 +101,9 @@ static struct super_operations asfs_ops = {
 //	.show_options   = generic_show_options,
 #ifdef CONFIG_ASFS_RW
 	.remount_fs		= asfs_remount,
+	.evict_inode	= asfs_evict_inode,
+	.write_super	= asfs_write_super,
+	.sync_fs		= asfs_sync_fs,
 #endif
 };
 
@@ -101,7 +111,8 @@ extern struct dentry_operations asfs_dentry_operations;
 
 enum {
 	Opt_mode, Opt_setgid, Opt_setuid, Opt_prefix, Opt_volume, 
-	Opt_lcvol, Opt_iocharset, Opt_codepage, Opt_ignore, Opt_err
+	Opt_lcvol, Opt_iocharset, Opt_codepage, Opt_prealloc, Opt_discard,
+	Opt_nodiscard, Opt_pinbitmap, Opt_nopinbitmap, Opt_ignore, Opt_err
 };
 
 static match_table_t tokens = {
@@ -113,6 +124,11 @@ static match_table_t tokens = {
 	{Opt_lcvol, "lowercasevol"},
 	{Opt_iocharset, "iocharset=%s"},
 	{Opt_codepage, "codepage=%s"},
+	{Opt_prealloc, "prealloc=%u"},
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_pinbitmap, "pinbitmap"},
+	{Opt_nopinbitmap, "nopinbitmap"},
 	{Opt_ignore, "grpquota"},
 	{Opt_ignore, "noquota"},
 	{Opt_ignore, "quota"},
@@ -187,6 +203,28 @@ static int asfs_parse_options(char *options, struct super_block *sb)
 			ASFS_SB(sb)->codepage = match_strdup(&args[0]);
 			if (!ASFS_SB(sb)->codepage)
 				return 0;
+			break;
+		case Opt_prealloc:
+			if (match_int(&args[0], &option))
+				goto no_arg;
+			if (option < ASFS_BLOCKCHUNKS)
+				option = ASFS_BLOCKCHUNKS;
+			if (option > ASFS_MAXBLOCKCHUNK)
+				option = ASFS_MAXBLOCKCHUNK;
+			ASFS_SB(sb)->prealloc_max = option;
+			break;
+		case Opt_discard:
+			ASFS_SB(sb)->flags |= ASFS_DISCARD;
+			break;
+		case Opt_nodiscard:
+			ASFS_SB(sb)->flags &= ~ASFS_DISCARD;
+			break;
+		case Opt_pinbitmap:
+			ASFS_SB(sb)->flags |= ASFS_PINBITMAP;
+			break;
+		case Opt_nopinbitmap:
+			ASFS_SB(sb)->flags &= ~ASFS_PINBITMAP;
+			break;
 		case Opt_ignore:
 		 	/* Silently ignore the quota options */
 			break;
@@ -221,6 +259,12 @@ static int asfs_fill_super(struct super_block *sb, void *data, int silent)
 	ASFS_SB(sb)->flags = 0;
 	ASFS_SB(sb)->iocharset = asfs_default_iocharset;
 	ASFS_SB(sb)->codepage = asfs_default_codepage;
+	ASFS_SB(sb)->prealloc_max = ASFS_DEFAULT_PREALLOC;
+	spin_lock_init(&ASFS_SB(sb)->reserve_lock);
+#ifdef CONFIG_ASFS_RW
+	asfs_initdiscards(sb);
+	asfs_initfrees(sb);
+#endif
 
 	if (!asfs_parse_options(data, sb)) {
 		printk(KERN_ERR "ASFS: Error parsing options\n");
@@ -274,6 +318,15 @@ static int asfs_fill_super(struct super_block *sb, void *data, int silent)
 			if ((tmpbh = asfs_breadcheck(sb, ASFS_SB(sb)->rootobjectcontainer, ASFS_OBJECTCONTAINER_ID))) {
 				struct fsRootInfo *ri = (struct fsRootInfo *)((u8 *)tmpbh->b_data + sb->s_blocksize - sizeof(struct fsRootInfo));
 				ASFS_SB(sb)->freeblocks = be32_to_cpu(ri->freeblocks);
+				ASFS_SB(sb)->deletedblocks = be32_to_cpu(ri->deletedblocks);
+				ASFS_SB(sb)->deletedfiles = be32_to_cpu(ri->deletedfiles);
+				ASFS_SB(sb)->lastallocatedadminspace = be32_to_cpu(ri->lastallocatedadminspace);
+				/* older volumes may only have the last allocated block */
+				ASFS_SB(sb)->block_rovingblockptr = be32_to_cpu(ri->rovingpointer);
+				if (ASFS_SB(sb)->block_rovingblockptr == 0)
+					ASFS_SB(sb)->block_rovingblockptr = be32_to_cpu(ri->lastallocatedblock);
+				if (ASFS_SB(sb)->block_rovingblockptr >= ASFS_SB(sb)->totalblocks)
+					ASFS_SB(sb)->block_rovingblockptr = 0;
 				asfs_brelse(tmpbh);
 			} else
 				ASFS_SB(sb)->freeblocks = 0;
@@ -337,6 +390,12 @@ static int asfs_fill_super(struct super_block *sb, void *data, int silent)
 	if ((rootinode = asfs_get_root_inode(sb))) {
 		if ((sb->s_root = d_alloc_root(rootinode))) {
 			sb->s_root->d_op = &asfs_dentry_operations;
+#ifdef CONFIG_ASFS_RW
+			/* bitmap block summaries, filled in as the blocks are read */
+			if ((ASFS_SB(sb)->bitmapsummary = vmalloc(ASFS_SB(sb)->blocks_bitmap * sizeof(struct asfs_bitmapsummary))))
+				memset(ASFS_SB(sb)->bitmapsummary, 0xFF, ASFS_SB(sb)->blocks_bitmap * sizeof(struct asfs_bitmapsummary));
+			asfs_setpinbitmap(sb, sb->s_flags & MS_RDONLY);
+#endif
 			return 0;
 		}
 		iput(rootinode);
@@ -352,6 +411,19 @@ out:
 }
 
 #ifdef CONFIG_ASFS_RW
+/* The bitmap is only kept pinned while the volume is writable. */
+
+static void asfs_setpinbitmap(struct super_block *sb, int readonly)
+{
+	lock_super(sb);
+	if ((ASFS_SB(sb)->flags & ASFS_PINBITMAP) && !readonly) {
+		if (asfs_pinbitmap(sb) != 0)
+			printk(KERN_WARNING "ASFS: Unable to keep the bitmap of dev %s in memory\n", sb->s_id);
+	} else
+		asfs_unpinbitmap(sb);
+	unlock_super(sb);
+}
+
 static int asfs_remount(struct super_block *sb, int *flags, char *data)
 {
 	asfs_debug("ASFS: remount (flags=0x%x, opts=\"%s\")\n",*flags,data);
@@ -359,17 +431,50 @@ static int asfs_remount(struct super_block *sb, int *flags, char *data)
 	if (!asfs_parse_options(data,sb))
 		return -EINVAL;
 
-	if ((*flags & MS_RDONLY) == (sb->s_flags & MS_RDONLY))
-		return 0;
+	/* nothing may be left to write once the filesystem is read-only,
+	   and the discard queue isn't used any more if discard was turned off */
+	asfs_flushfrees(sb);
+	asfs_flushdiscards(sb);
+	if (sb->s_dirt)
+		asfs_write_super(sb);
+
+	if ((*flags & MS_RDONLY) != (sb->s_flags & MS_RDONLY)) {
+		if (*flags & MS_RDONLY) {
+			sb->s_flags |= MS_RDONLY;
+		} else if (!(ASFS_SB(sb)->flags & ASFS_READONLY)) {
+			sb->s_flags &= ~MS_RDONLY;
+		} else {
+			printk("VFS: Can't remount Amiga SFS on dev %s read/write because of errors.", sb->s_id);
+			return -EINVAL;
+		}
+	}
 
-	if (*flags & MS_RDONLY) {
-		sb->s_flags |= MS_RDONLY;
-	} else if (!(ASFS_SB(sb)->flags & ASFS_READONLY)) {
-		sb->s_flags &= ~MS_RDONLY;
-	} else {
-		printk("VFS: Can't remount Amiga SFS on dev %s read/write because of errors.", sb->s_id);
-		return -EINVAL;
+	asfs_setpinbitmap(sb, sb->s_flags & MS_RDONLY);
+
+	/* a free space index which failed is given another chance */
+	lock_super(sb);
+	ASFS_SB(sb)->space_noindex = FALSE;
+	unlock_super(sb);
+	return 0;
+}
+
+/* Called periodically and on sync, writes back the fsRootInfo counters
+   and the pinned bitmap blocks, which allocations only change in memory. */
+
+static void asfs_write_super(struct super_block *sb)
+{
+	lock_super(sb);
+	if (sb->s_dirt && !(sb->s_flags & MS_RDONLY)) {
+		asfs_writerootinfo(sb);
+		asfs_writebitmap(sb);
 	}
+	sb->s_dirt = 0;
+	unlock_super(sb);
+}
+
+static int asfs_sync_fs(struct super_block *sb, int wait)
+{
+	asfs_write_super(sb);
 	return 0;
 }
 #endif
@@ -390,6 +495,16 @@ static void asfs_put_super(struct super_block *sb)
 		kfree(ASFS_SB(sb)->iocharset);
 	if (ASFS_SB(sb)->codepage != asfs_default_codepage)
 		kfree(ASFS_SB(sb)->codepage);
+#ifdef CONFIG_ASFS_RW
+	asfs_flushfrees(sb);
+	asfs_flushdiscards(sb);
+	if (sb->s_dirt)
+		asfs_write_super(sb);
+	asfs_unpinbitmap(sb);
+	asfs_dropspaceindex(sb);
+	asfs_dropadminareas(sb);
+	vfree(ASFS_SB(sb)->bitmapsummary);
+#endif
 
 	kfree(sbi);
 	sb->s_fs_info = NULL;
@@ -400,10 +515,16 @@ static void asfs_put_super(struct super_block *sb)
 static int asfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	struct super_block *sb = dentry->d_sb;
+	u32 freeblocks;
+
+	spin_lock(&ASFS_SB(sb)->reserve_lock);
+	freeblocks = ASFS_SB(sb)->freeblocks + ASFS_SB(sb)->pendingfree;
+	freeblocks = freeblocks > ASFS_SB(sb)->reservedblocks ? freeblocks - ASFS_SB(sb)->reservedblocks : 0;
+	spin_unlock(&ASFS_SB(sb)->reserve_lock);
 
 	buf->f_type = ASFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
-	buf->f_bfree = buf->f_bavail = ASFS_SB(sb)->freeblocks;
+	buf->f_bfree = buf->f_bavail = freeblocks;
 	buf->f_blocks = ASFS_SB(sb)->totalblocks;
 	buf->f_namelen = ASFS_MAXFN;
 	return 0;
@@ -418,13 +539,39 @@ static struct inode *asfs_alloc_inode(struct super_block *sb)
 	if (!i)
 		return NULL;
 	i->vfs_inode.i_version = 1;
+	i->ext_map = NULL;
+	i->ext_count = 0;
+	i->lastextent = 0;
+	i->ext_size = 0;
+	i->reserved = 0;
+	i->metareserved = 0;
+	i->prealloc = ASFS_BLOCKCHUNKS;
 	return &i->vfs_inode;
 }
 
 static void asfs_destroy_inode(struct inode *inode)
 {
+	kfree(ASFS_I(inode)->ext_map);
 	kmem_cache_free(asfs_inode_cachep, ASFS_I(inode));
 }
+
+#ifdef CONFIG_ASFS_RW
+/* Delayed blocks which were never allocated, because writeback failed or
+   the object was deleted while still open, are still reserved, give them
+   back when the inode goes. */
+
+static void asfs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages(&inode->i_data, 0);
+	end_writeback(inode);
+
+	spin_lock(&ASFS_SB(inode->i_sb)->reserve_lock);
+	asfs_unreservespace(inode->i_sb, ASFS_I(inode)->reserved + ASFS_I(inode)->metareserved);
+	ASFS_I(inode)->reserved = 0;
+	ASFS_I(inode)->metareserved = 0;
+	spin_unlock(&ASFS_SB(inode->i_sb)->reserve_lock);
+}
+#endif
 static void init_once(void *foo)
 {
 	struct asfs_inode_info *ei = (struct asfs_inode_info *) foo;